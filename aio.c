@@ -0,0 +1,577 @@
+/*
+ * file:        aio.c
+ *
+ * description: asynchronous file I/O for block devices of the
+ *              CS 7600 / CS 5600 file system. Requests are queued
+ *              on an io_uring if the kernel supports it, otherwise
+ *              on a pool of worker threads doing pread and pwrite.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "aio.h"
+#include "blkdev.h"
+
+/* after blkdev.h: linux/fs.h defines a BLOCK_SIZE macro of its own */
+#include <linux/io_uring.h>
+
+/** number of worker threads when io_uring is not available */
+enum {AIO_THREADS = 4};
+
+/** io_uring submission and completion rings */
+struct uring {
+    int       fd;               // io_uring file descriptor
+    unsigned *sq_head;          // submission ring head
+    unsigned *sq_tail;          // submission ring tail
+    unsigned *sq_mask;          // submission ring index mask
+    unsigned *sq_array;         // submission ring sqe indexes
+    unsigned  sq_entries;       // submission ring size
+    struct io_uring_sqe *sqes;  // submission queue entries
+    unsigned *cq_head;          // completion ring head
+    unsigned *cq_tail;          // completion ring tail
+    unsigned *cq_mask;          // completion ring index mask
+    unsigned  cq_entries;       // completion ring size
+    struct io_uring_cqe *cqes;  // completion queue entries
+    void     *sq_ring;          // mapped submission ring
+    size_t    sq_ring_sz;       // size of mapped submission ring
+    void     *cq_ring;          // mapped completion ring
+    size_t    cq_ring_sz;       // size of mapped completion ring
+    size_t    sqes_sz;          // size of mapped submission entries
+};
+
+/** asynchronous I/O context for a file */
+struct aio {
+    int   fd;                   // file descriptor of file
+    int   use_uring;            // 1 if using io_uring, 0 if threads
+    struct uring ring;          // io_uring state
+    pthread_mutex_t sq_lock;    // serializes io_uring submission
+    pthread_mutex_t lock;       // protects completion state and queue
+    pthread_cond_t  work;       // signals workers of queued requests
+    pthread_cond_t  done;       // signals waiters of completions
+    struct blkdev_req *head;    // queued requests for workers
+    struct blkdev_req *tail;    // last queued request
+    int   waiting;              // 1 while a thread waits in io_uring_enter
+    unsigned inflight;          // io_uring requests submitted and not reaped
+    int   stop;                 // 1 when workers should exit
+    pthread_t threads[AIO_THREADS]; // worker threads
+};
+
+/**
+ * Record result of a transfer in a request.
+ *
+ * @param req the request
+ * @param result the number of bytes transferred or -errno
+ */
+static void aio_finish(struct blkdev_req *req, ssize_t result)
+{
+    if (result != (ssize_t)req->num_blks*BLOCK_SIZE) {
+        fprintf(stderr, "async %s error at block %lld: %s\n",
+                (req->op == BLKDEV_WRITE) ? "write" : "read", (long long)req->first_blk,
+                (result < 0) ? strerror(-result) : "short transfer");
+        req->status = E_UNAVAIL;
+    } else {
+        req->status = SUCCESS;
+    }
+    req->done = 1;
+}
+
+/**
+ * Determine whether all requests are done.
+ *
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all succeeded, first error if all done,
+ *   or 1 if some are not done
+ */
+static int aio_status(struct blkdev_req *reqs, int nreqs)
+{
+    int val = SUCCESS;
+    for (int i = 0; i < nreqs; i++) {
+        if (!reqs[i].done) {
+            return 1;
+        }
+        if (val == SUCCESS) {
+            val = reqs[i].status;
+        }
+    }
+    return val;
+}
+
+/**
+ * Set up an io_uring for the context.
+ *
+ * @param aio the context
+ * @param depth the number of submission queue entries
+ * @return 0 if successful, -1 if io_uring not available
+ */
+static int uring_setup(struct aio *aio, int depth)
+{
+    struct uring *r = &aio->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    // IORING_OP_READ and IORING_OP_WRITE arrived with FAST_POLL
+    if ((p.features & IORING_FEAT_FAST_POLL) == 0) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz) {
+            r->sq_ring_sz = r->cq_ring_sz;
+        }
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ring != r->sq_ring) {
+            munmap(r->cq_ring, r->cq_ring_sz);
+        }
+        munmap(r->sq_ring, r->sq_ring_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cq_entries = p.cq_entries;
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Enter the io_uring to submit entries and/or wait for completions.
+ *
+ * @param r the ring
+ * @param to_submit number of entries to submit
+ * @param min_complete number of completions to wait for
+ * @return number of entries submitted, or -1 on error
+ */
+static int uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int val;
+    do {
+        val = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                      flags, NULL, 0);
+    } while (val < 0 && errno == EINTR);
+    return val;
+}
+
+/**
+ * Record all available io_uring completions in their requests.
+ * Called with the context lock held.
+ *
+ * @param aio the context
+ * @return the number of completions reaped
+ */
+static int uring_reap(struct aio *aio)
+{
+    struct uring *r = &aio->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for ( ; head != tail; head++, n++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        aio_finish((struct blkdev_req*)(uintptr_t)cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    aio->inflight -= n;
+    return n;
+}
+
+/**
+ * Reap io_uring completions, or wait for more if there are none.
+ * One thread at a time waits in the kernel, without holding the
+ * lock, and reaps when it returns; the rest wait for it to signal
+ * new completions rather than reap themselves, so the completion
+ * it waits for cannot be taken from under it. Called with the
+ * context lock held.
+ *
+ * @param aio the context
+ * @return 0 if successful, -1 if the wait failed
+ */
+static int uring_wait(struct aio *aio)
+{
+    if (aio->waiting) {
+        pthread_cond_wait(&aio->done, &aio->lock);
+        return 0;
+    }
+    if (uring_reap(aio) > 0) {
+        pthread_cond_broadcast(&aio->done);
+        return 0;
+    }
+
+    aio->waiting = 1;
+    pthread_mutex_unlock(&aio->lock);
+    int m = uring_enter(&aio->ring, 0, 1);
+    int err = errno;
+    pthread_mutex_lock(&aio->lock);
+    aio->waiting = 0;
+    uring_reap(aio);
+    pthread_cond_broadcast(&aio->done);
+    if (m < 0) {
+        fprintf(stderr, "io_uring wait error: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait for requests queued on the io_uring. Completions of other
+ * waiters' requests are recorded along the way.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or the first error
+ */
+static int uring_complete(struct aio *aio, struct blkdev_req *reqs, int nreqs)
+{
+    int val;
+
+    pthread_mutex_lock(&aio->lock);
+    while ((val = aio_status(reqs, nreqs)) > 0) {
+        if (uring_wait(aio) < 0) {
+            val = E_UNAVAIL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return val;
+}
+
+/**
+ * Queue requests on the io_uring and submit them to the kernel.
+ * No more requests are in flight than the completion ring holds,
+ * so no completion is dropped or refused; a batch that would
+ * overflow it waits for earlier requests to complete. If the
+ * kernel reports an error, the entries it did not consume are
+ * taken back out of the ring and fail. The requests it did
+ * consume are waited for, so none is still in flight when the
+ * error is returned.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, E_UNAVAIL on error
+ */
+static int uring_submit(struct aio *aio, struct blkdev_req *reqs, int nreqs)
+{
+    struct uring *r = &aio->ring;
+    int val = SUCCESS;
+    int nsubmitted = 0;
+
+    pthread_mutex_lock(&aio->sq_lock);
+    while (nsubmitted < nreqs && val == SUCCESS) {
+        // claim room in the completion ring for this pass
+        pthread_mutex_lock(&aio->lock);
+        while (aio->inflight >= r->cq_entries && val == SUCCESS) {
+            if (uring_wait(aio) < 0) {
+                val = E_UNAVAIL;
+            }
+        }
+        unsigned room = r->cq_entries - aio->inflight;
+        if (room > r->sq_entries) {
+            room = r->sq_entries;
+        }
+        if (room > (unsigned)(nreqs - nsubmitted)) {
+            room = nreqs - nsubmitted;
+        }
+        if (val != SUCCESS) {
+            room = 0;
+        }
+        aio->inflight += room;
+        pthread_mutex_unlock(&aio->lock);
+        if (room == 0) {
+            break;
+        }
+
+        // fill the claimed entries
+        unsigned tail = *r->sq_tail;
+        unsigned n;
+        for (n = 0; n < room; n++) {
+            struct blkdev_req *req = &reqs[nsubmitted + n];
+            unsigned idx = (tail + n) & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = aio->fd;
+            if (req->iov != NULL) {
+                sqe->opcode = (req->op == BLKDEV_WRITE) ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->addr = (uintptr_t)req->iov;
+                sqe->len = req->iovcnt;
+            } else {
+                sqe->opcode = (req->op == BLKDEV_WRITE) ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->addr = (uintptr_t)req->buf;
+                sqe->len = req->num_blks * BLOCK_SIZE;
+            }
+            sqe->off = (off_t)req->first_blk * BLOCK_SIZE;
+            sqe->user_data = (uintptr_t)req;
+            r->sq_array[idx] = idx;
+        }
+        __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+        // kernel consumes all entries unless it reports an error;
+        // EBUSY means completions must be reaped first
+        unsigned consumed = 0;
+        while (consumed < n) {
+            int m = uring_enter(r, n - consumed, 0);
+            if (m < 0 && errno == EBUSY) {
+                pthread_mutex_lock(&aio->lock);
+                int w = uring_wait(aio);
+                pthread_mutex_unlock(&aio->lock);
+                if (w == 0) {
+                    continue;
+                }
+            }
+            if (m < 0) {
+                fprintf(stderr, "io_uring submit error: %s\n", strerror(errno));
+                // entries left in the ring would go to a later submit
+                __atomic_store_n(r->sq_tail, tail + consumed, __ATOMIC_RELEASE);
+                pthread_mutex_lock(&aio->lock);
+                aio->inflight -= n - consumed;
+                pthread_mutex_unlock(&aio->lock);
+                val = E_UNAVAIL;
+                break;
+            }
+            consumed += m;
+        }
+        nsubmitted += consumed;
+    }
+    pthread_mutex_unlock(&aio->sq_lock);
+
+    if (val != SUCCESS) {
+        for (int i = nsubmitted; i < nreqs; i++) {
+            reqs[i].status = E_UNAVAIL;
+            reqs[i].done = 1;
+        }
+        uring_complete(aio, reqs, nsubmitted);
+    }
+    return val;
+}
+
+/**
+ * Worker thread that performs queued requests with pread and pwrite.
+ *
+ * @param arg the context
+ * @return unused - returns NULL
+ */
+static void *aio_worker(void *arg)
+{
+    struct aio *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        while (!aio->stop && aio->head == NULL) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+        if (aio->head == NULL) {
+            break;  // stopped and queue drained
+        }
+        struct blkdev_req *req = aio->head;
+        if ((aio->head = req->next) == NULL) {
+            aio->tail = NULL;
+        }
+        pthread_mutex_unlock(&aio->lock);
+
+        size_t len = (size_t)req->num_blks * BLOCK_SIZE;
+        off_t offset = (off_t)req->first_blk * BLOCK_SIZE;
+        ssize_t result;
+        if (req->iov != NULL) {
+            result = (req->op == BLKDEV_WRITE)
+                ? pwritev(aio->fd, req->iov, req->iovcnt, offset)
+                : preadv(aio->fd, req->iov, req->iovcnt, offset);
+        } else {
+            result = (req->op == BLKDEV_WRITE)
+                ? pwrite(aio->fd, req->buf, len, offset)
+                : pread(aio->fd, req->buf, len, offset);
+        }
+
+        pthread_mutex_lock(&aio->lock);
+        aio_finish(req, (result < 0) ? -errno : result);
+        pthread_cond_broadcast(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return NULL;
+}
+
+/**
+ * Create an asynchronous I/O context for a file. Uses io_uring
+ * if the kernel supports it, otherwise a pool of worker threads
+ * that perform pread and pwrite.
+ *
+ * @param fd the file descriptor
+ * @param depth the maximum number of requests in flight
+ * @return the context or NULL if cannot be created
+ */
+struct aio *aio_create(int fd, int depth)
+{
+    struct aio *aio = calloc(1, sizeof(*aio));
+    if (aio == NULL) {
+        return NULL;
+    }
+
+    aio->fd = fd;
+    pthread_mutex_init(&aio->sq_lock, NULL);
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+
+    if (uring_setup(aio, depth) == 0) {
+        aio->use_uring = 1;
+        return aio;
+    }
+
+    // fall back to worker threads
+    for (int i = 0; i < AIO_THREADS; i++) {
+        if (pthread_create(&aio->threads[i], NULL, aio_worker, aio) != 0) {
+            fprintf(stderr, "can't create I/O thread: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    return aio;
+}
+
+/**
+ * Queue block device requests on the file without waiting.
+ * Block numbers are converted to file offsets of BLOCK_SIZE
+ * byte blocks. Requests with an iov are transferred with a
+ * single vectored operation; num_blks must still give the
+ * total number of blocks.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if queued
+ */
+int aio_submit(struct aio *aio, struct blkdev_req *reqs, int nreqs)
+{
+    for (int i = 0; i < nreqs; i++) {
+        reqs[i].done = 0;
+        reqs[i].next = NULL;
+    }
+    if (aio->use_uring) {
+        return uring_submit(aio, reqs, nreqs);
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    for (int i = 0; i < nreqs; i++) {
+        if (aio->tail == NULL) {
+            aio->head = &reqs[i];
+        } else {
+            aio->tail->next = &reqs[i];
+        }
+        aio->tail = &reqs[i];
+    }
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Wait for queued requests to complete.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or the first error
+ */
+int aio_complete(struct aio *aio, struct blkdev_req *reqs, int nreqs)
+{
+    if (aio->use_uring) {
+        return uring_complete(aio, reqs, nreqs);
+    }
+
+    int val;
+    pthread_mutex_lock(&aio->lock);
+    while ((val = aio_status(reqs, nreqs)) > 0) {
+        pthread_cond_wait(&aio->done, &aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return val;
+}
+
+/**
+ * Release the context. All submitted requests must have been
+ * completed with aio_complete().
+ *
+ * @param aio the context
+ */
+void aio_close(struct aio *aio)
+{
+    if (aio->use_uring) {
+        struct uring *r = &aio->ring;
+        munmap(r->sqes, r->sqes_sz);
+        if (r->cq_ring != r->sq_ring) {
+            munmap(r->cq_ring, r->cq_ring_sz);
+        }
+        munmap(r->sq_ring, r->sq_ring_sz);
+        close(r->fd);
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        aio->stop = 1;
+        pthread_cond_broadcast(&aio->work);
+        pthread_mutex_unlock(&aio->lock);
+        for (int i = 0; i < AIO_THREADS; i++) {
+            pthread_join(aio->threads[i], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&aio->done);
+    pthread_cond_destroy(&aio->work);
+    pthread_mutex_destroy(&aio->lock);
+    pthread_mutex_destroy(&aio->sq_lock);
+    free(aio);
+}
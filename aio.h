@@ -0,0 +1,61 @@
+/*
+ * file:        aio.h
+ *
+ * description: asynchronous file I/O for block devices of the
+ *              CS 7600 / CS 5600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef AIO_H_
+#define AIO_H_
+
+#include "blkdev.h"
+
+/** asynchronous I/O context for a file */
+struct aio;
+
+/**
+ * Create an asynchronous I/O context for a file. Uses io_uring
+ * if the kernel supports it, otherwise a pool of worker threads
+ * that perform pread and pwrite.
+ *
+ * @param fd the file descriptor
+ * @param depth the maximum number of requests in flight
+ * @return the context or NULL if cannot be created
+ */
+extern struct aio *aio_create(int fd, int depth);
+
+/**
+ * Queue block device requests on the file without waiting.
+ * Block numbers are converted to file offsets of BLOCK_SIZE
+ * byte blocks. Requests with an iov are transferred with a
+ * single vectored operation; num_blks must still give the
+ * total number of blocks.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if queued
+ */
+extern int aio_submit(struct aio *aio, struct blkdev_req *reqs, int nreqs);
+
+/**
+ * Wait for queued requests to complete.
+ *
+ * @param aio the context
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or the first error
+ */
+extern int aio_complete(struct aio *aio, struct blkdev_req *reqs, int nreqs);
+
+/**
+ * Release the context. All submitted requests must have been
+ * completed with aio_complete().
+ *
+ * @param aio the context
+ */
+extern void aio_close(struct aio *aio);
+
+#endif /* AIO_H_ */
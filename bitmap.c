@@ -0,0 +1,120 @@
+/*
+ * file:        bitmap.c
+ *
+ * description: word-at-a-time bitmaps for the inode and block maps
+ *              of the CS 5600 / 7600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include "bitmap.h"
+
+/**
+ * Find the first clear bit in [start, end).
+ *
+ * @param map the bitmap
+ * @param start the first bit number
+ * @param end the bit number after the last one
+ * @return the number of a clear bit, or -1 if all bits are set
+ */
+static int64_t find_clear(const bitmap_t *map, int64_t start, int64_t end)
+{
+    int64_t w = start / BITMAP_WORD_BITS;
+    int64_t last = (end - 1) / BITMAP_WORD_BITS;
+
+    // ignore the bits before start in the first word
+    bitmap_t free = ~map[w] & (~(bitmap_t)0 << (start % BITMAP_WORD_BITS));
+    while (free == 0) {
+        if (++w > last) {
+            return -1;
+        }
+        free = ~map[w];
+    }
+
+    int64_t n = w * BITMAP_WORD_BITS + __builtin_ctzll(free);
+    return (n < end) ? n : -1;
+}
+
+/**
+ * Find the first clear bit at or after start, wrapping around
+ * to the beginning of the bitmap. Whole words are tested at
+ * a time, so full regions are skipped 64 bits per step.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @param start the bit number to start searching at
+ * @return the number of a clear bit, or -1 if all bits are set
+ */
+int64_t bit_find_clear(const bitmap_t *map, int64_t nbits, int64_t start)
+{
+    if (nbits <= 0) {
+        return -1;
+    }
+    if (start < 0 || start >= nbits) {
+        start = 0;
+    }
+
+    int64_t n = find_clear(map, start, nbits);
+    if (n < 0 && start > 0) {
+        n = find_clear(map, 0, start);
+    }
+    return n;
+}
+
+/**
+ * Find the length of the run of clear bits starting at start.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @param start the first bit number of the run
+ * @param max the maximum length to return
+ * @return the number of consecutive clear bits, at most max
+ */
+int64_t bit_clear_run(const bitmap_t *map, int64_t nbits, int64_t start, int64_t max)
+{
+    if (max > nbits - start) {
+        max = nbits - start;
+    }
+    if (max <= 0) {
+        return 0;
+    }
+
+    int64_t n = 0;
+    while (n < max) {
+        int64_t i = start + n;
+        int off = i % BITMAP_WORD_BITS;
+
+        // set bits of the word from bit i on end the run
+        bitmap_t used = map[i / BITMAP_WORD_BITS] >> off;
+        if (used != 0) {
+            n += __builtin_ctzll(used);
+            break;
+        }
+        n += BITMAP_WORD_BITS - off;
+    }
+    return (n < max) ? n : max;
+}
+
+/**
+ * Count the clear bits of a bitmap a word at a time.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @return the number of clear bits
+ */
+int64_t bit_count_clear(const bitmap_t *map, int64_t nbits)
+{
+    int64_t nwords = nbits / BITMAP_WORD_BITS;
+    int64_t count = 0;
+    for (int64_t w = 0; w < nwords; w++) {
+        count += __builtin_popcountll(~map[w]);
+    }
+
+    // count only the bits before nbits in the last word
+    int rest = nbits % BITMAP_WORD_BITS;
+    if (rest > 0) {
+        bitmap_t mask = ((bitmap_t)1 << rest) - 1;
+        count += __builtin_popcountll(~map[nwords] & mask);
+    }
+    return count;
+}
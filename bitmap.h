@@ -0,0 +1,91 @@
+/*
+ * file:        bitmap.h
+ *
+ * description: word-at-a-time bitmaps for the inode and block maps
+ *              of the CS 5600 / 7600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include <stdint.h>
+
+/**
+ * A bitmap is an array of 64-bit words. Bit n is bit (n % 64)
+ * of word (n / 64), which is the same on-disk layout as the
+ * fd_set maps of earlier images on a little-endian host.
+ */
+typedef uint64_t bitmap_t;
+
+/** number of bits in a bitmap word */
+enum {BITMAP_WORD_BITS = 64};
+
+/**
+ * Determines whether a bit is set.
+ *
+ * @param map the bitmap
+ * @param n the bit number
+ * @return 1 (true) or 0 (false)
+ */
+static inline int bit_test(const bitmap_t *map, int64_t n)
+{
+    return (map[n / BITMAP_WORD_BITS] >> (n % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Set a bit.
+ *
+ * @param map the bitmap
+ * @param n the bit number
+ */
+static inline void bit_set(bitmap_t *map, int64_t n)
+{
+    map[n / BITMAP_WORD_BITS] |= (bitmap_t)1 << (n % BITMAP_WORD_BITS);
+}
+
+/**
+ * Clear a bit.
+ *
+ * @param map the bitmap
+ * @param n the bit number
+ */
+static inline void bit_clear(bitmap_t *map, int64_t n)
+{
+    map[n / BITMAP_WORD_BITS] &= ~((bitmap_t)1 << (n % BITMAP_WORD_BITS));
+}
+
+/**
+ * Find the first clear bit at or after start, wrapping around
+ * to the beginning of the bitmap. Whole words are tested at
+ * a time, so full regions are skipped 64 bits per step.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @param start the bit number to start searching at
+ * @return the number of a clear bit, or -1 if all bits are set
+ */
+extern int64_t bit_find_clear(const bitmap_t *map, int64_t nbits, int64_t start);
+
+/**
+ * Find the length of the run of clear bits starting at start.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @param start the first bit number of the run
+ * @param max the maximum length to return
+ * @return the number of consecutive clear bits, at most max
+ */
+extern int64_t bit_clear_run(const bitmap_t *map, int64_t nbits, int64_t start, int64_t max);
+
+/**
+ * Count the clear bits of a bitmap a word at a time.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @return the number of clear bits
+ */
+extern int64_t bit_count_clear(const bitmap_t *map, int64_t nbits);
+
+#endif /* BITMAP_H_ */
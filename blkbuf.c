@@ -0,0 +1,87 @@
+/*
+ * file:        blkbuf.c
+ *
+ * description: pool of aligned block buffers for CS 7600 / CS 5600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "blkbuf.h"
+#include "blkdev.h"
+
+/** maximum number of single block buffers kept in the pool */
+enum {BLKBUF_POOL_MAX = 256};
+
+/** free single block buffer, linked through its first word */
+struct blkbuf {
+    struct blkbuf *next;
+};
+
+/** free single block buffers */
+static struct blkbuf *pool = NULL;
+
+/** number of buffers in pool */
+static int pool_size = 0;
+
+/** protects pool */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get an aligned buffer for nblks BLOCK_SIZE blocks. Single
+ * block buffers are reused from the pool.
+ *
+ * @param nblks the number of blocks
+ * @return the buffer, or NULL if cannot be allocated
+ */
+void *blkbuf_alloc(int nblks)
+{
+    if (nblks == 1) {
+        pthread_mutex_lock(&pool_lock);
+        struct blkbuf *b = pool;
+        if (b != NULL) {
+            pool = b->next;
+            pool_size--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (b != NULL) {
+            return b;
+        }
+    }
+
+    void *buf;
+    if (posix_memalign(&buf, BLKBUF_ALIGN, (size_t)nblks*BLOCK_SIZE) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * Return a buffer from blkbuf_alloc().
+ *
+ * @param buf the buffer
+ * @param nblks the number of blocks it was allocated for
+ */
+void blkbuf_free(void *buf, int nblks)
+{
+    if (buf == NULL) {
+        return;
+    }
+    if (nblks == 1) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_size < BLKBUF_POOL_MAX) {
+            struct blkbuf *b = buf;
+            b->next = pool;
+            pool = b;
+            pool_size++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    free(buf);
+}
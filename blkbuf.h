@@ -0,0 +1,48 @@
+/*
+ * file:        blkbuf.h
+ *
+ * description: pool of aligned block buffers for CS 7600 / CS 5600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef BLKBUF_H_
+#define BLKBUF_H_
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/** alignment of pool buffers: suitable for O_DIRECT transfers */
+enum {BLKBUF_ALIGN = 4096};
+
+/**
+ * Determines whether a buffer is aligned for O_DIRECT transfers.
+ *
+ * @param buf the buffer
+ * @return 1 (true) if aligned, 0 (false) otherwise
+ */
+static inline int blkbuf_aligned(const void *buf)
+{
+    return ((uintptr_t)buf % BLKBUF_ALIGN) == 0;
+}
+
+/**
+ * Get an aligned buffer for nblks BLOCK_SIZE blocks. Single
+ * block buffers are reused from the pool.
+ *
+ * @param nblks the number of blocks
+ * @return the buffer, or NULL if cannot be allocated
+ */
+extern void *blkbuf_alloc(int nblks);
+
+/**
+ * Return a buffer from blkbuf_alloc().
+ *
+ * @param buf the buffer
+ * @param nblks the number of blocks it was allocated for
+ */
+extern void blkbuf_free(void *buf, int nblks);
+
+#endif /* BLKBUF_H_ */
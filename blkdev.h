@@ -8,12 +8,38 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 /**  block device block size */
 enum {BLOCK_SIZE = 1024};
 
+/** block number on a block device; 64 bits for devices over 2 GiB */
+typedef int64_t blkno_t;
+
 /** block device operation status */
 enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
 
+/** block device hints */
+enum {BLKDEV_HINT_META = 1};
+
+/** block device request operations */
+enum {BLKDEV_READ = 0, BLKDEV_WRITE = 1};
+
+/** Asynchronous block device request */
+struct blkdev_req {
+    int   op;					/* BLKDEV_READ or BLKDEV_WRITE */
+    blkno_t first_blk;			/* first block to transfer */
+    int   num_blks;				/* number of blocks to transfer */
+    void *buf;					/* data buffer, if iov is NULL */
+    const struct iovec *iov;	/* data buffers, each a multiple of blocks */
+    int   iovcnt;				/* number of data buffers */
+    int   status;				/* SUCCESS or error, set on completion */
+    int   done;				/* set to 1 on completion */
+    struct blkdev_req *next;	/* used by block device while queued */
+};
+
 /** Definition of a block device */
 struct blkdev {
     struct blkdev_ops *ops;		/* operations on block device */
@@ -22,11 +48,184 @@ struct blkdev {
 
 /** Operations on a block device */
 struct blkdev_ops {
-    int  (*num_blocks)(struct blkdev *dev);
-    int  (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
+    blkno_t (*num_blocks)(struct blkdev *dev);
+    int  (*read)(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf);
+    int  (*write)(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf);
+    int  (*flush)(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks);
     void (*close)(struct blkdev *dev);
+
+    /* optional: transfer contiguous blocks to/from several buffers */
+    int  (*readv)(struct blkdev *dev, blkno_t first_blk, const struct iovec *iov, int iovcnt);
+    int  (*writev)(struct blkdev *dev, blkno_t first_blk, const struct iovec *iov, int iovcnt);
+
+    /* optional: start requests without waiting, and wait for them */
+    int  (*submit)(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
+    int  (*complete)(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
+
+    /* optional: release storage of blocks whose content is no longer needed */
+    int  (*discard)(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks);
+
+    /* optional: advise how blocks are used */
+    int  (*hint)(struct blkdev *dev, blkno_t first_blk, int num_blks, int hint);
+
+    /* optional: start reading blocks that will be needed soon */
+    int  (*prefetch)(struct blkdev *dev, blkno_t first_blk, int num_blks);
 };
 
+/**
+ * Read contiguous blocks into several buffers. The length of
+ * each buffer must be a multiple of BLOCK_SIZE. Devices without
+ * vectored support read each buffer separately.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to read
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error from device
+ */
+static inline int blkdev_readv(struct blkdev *dev, blkno_t first_blk,
+                               const struct iovec *iov, int iovcnt)
+{
+    if (dev->ops->readv != NULL) {
+        return dev->ops->readv(dev, first_blk, iov, iovcnt);
+    }
+    int val = SUCCESS;
+    for (int i = 0; i < iovcnt && val == SUCCESS; i++) {
+        int n = iov[i].iov_len / BLOCK_SIZE;
+        val = dev->ops->read(dev, first_blk, n, iov[i].iov_base);
+        first_blk += n;
+    }
+    return val;
+}
+
+/**
+ * Write contiguous blocks from several buffers. The length of
+ * each buffer must be a multiple of BLOCK_SIZE. Devices without
+ * vectored support write each buffer separately.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to write
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error from device
+ */
+static inline int blkdev_writev(struct blkdev *dev, blkno_t first_blk,
+                                const struct iovec *iov, int iovcnt)
+{
+    if (dev->ops->writev != NULL) {
+        return dev->ops->writev(dev, first_blk, iov, iovcnt);
+    }
+    int val = SUCCESS;
+    for (int i = 0; i < iovcnt && val == SUCCESS; i++) {
+        int n = iov[i].iov_len / BLOCK_SIZE;
+        val = dev->ops->write(dev, first_blk, n, iov[i].iov_base);
+        first_blk += n;
+    }
+    return val;
+}
+
+/**
+ * Tell a block device that blocks no longer hold data, so it can
+ * release their storage. The content of discarded blocks is
+ * undefined until they are written again.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to discard
+ * @param num_blks the number of blocks
+ * @return SUCCESS if successful, or error from device
+ */
+static inline int blkdev_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    if (dev->ops->discard != NULL) {
+        return dev->ops->discard(dev, first_blk, num_blks);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Advise a block device how blocks are used. BLKDEV_HINT_META
+ * marks blocks just read or written as file system metadata,
+ * which caching devices keep in preference to file data.
+ * Devices without hint support ignore it.
+ *
+ * @param dev the block device
+ * @param first_blk the first block
+ * @param num_blks the number of blocks
+ * @param hint the hint
+ */
+static inline void blkdev_hint(struct blkdev *dev, blkno_t first_blk, int num_blks, int hint)
+{
+    if (dev->ops->hint != NULL) {
+        dev->ops->hint(dev, first_blk, num_blks, hint);
+    }
+}
+
+/**
+ * Tell a block device that blocks will be read soon, so it can
+ * start reading them without the caller waiting. Devices without
+ * prefetch support ignore it.
+ *
+ * @param dev the block device
+ * @param first_blk the first block
+ * @param num_blks the number of blocks
+ */
+static inline void blkdev_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    if (dev->ops->prefetch != NULL) {
+        dev->ops->prefetch(dev, first_blk, num_blks);
+    }
+}
+
+/**
+ * Submit requests to a block device without waiting for them
+ * to complete. Devices without asynchronous support perform
+ * the requests before returning.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, E_UNAVAIL if device unavailable
+ */
+static inline int blkdev_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    if (dev->ops->submit != NULL) {
+        return dev->ops->submit(dev, reqs, nreqs);
+    }
+    for (int i = 0; i < nreqs; i++) {
+        struct blkdev_req *r = &reqs[i];
+        if (r->iov != NULL) {
+            r->status = (r->op == BLKDEV_WRITE)
+                ? blkdev_writev(dev, r->first_blk, r->iov, r->iovcnt)
+                : blkdev_readv(dev, r->first_blk, r->iov, r->iovcnt);
+        } else {
+            r->status = (r->op == BLKDEV_WRITE)
+                ? dev->ops->write(dev, r->first_blk, r->num_blks, r->buf)
+                : dev->ops->read(dev, r->first_blk, r->num_blks, r->buf);
+        }
+        r->done = 1;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Wait for submitted requests to complete.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or the first error
+ */
+static inline int blkdev_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    if (dev->ops->complete != NULL) {
+        return dev->ops->complete(dev, reqs, nreqs);
+    }
+    for (int i = 0; i < nreqs; i++) {
+        if (reqs[i].status != SUCCESS) {
+            return reqs[i].status;
+        }
+    }
+    return SUCCESS;
+}
+
 #endif
@@ -0,0 +1,650 @@
+/*
+ * file:        cache.c
+ *
+ * description: caching block device for CS 7600 / CS 5600 file system
+ *              layered over any other block device
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "cache.h"
+
+/** cached block */
+struct cache_ent {
+    blkno_t blkno;                  // block number, -1 if unused
+    int   dirty;                    // 1 if not yet written to device
+    int   in_a1;                    // 1 if on 2Q first-access queue
+    int   meta;                     // 1 if holds file system metadata
+    int   chance;                   // 1 if metadata may skip eviction once
+    struct cache_ent *hnext;        // next entry in hash chain
+    struct cache_ent *prev, *next;  // LRU list links
+    char  data[BLOCK_SIZE];         // block content
+};
+
+/** block number of a block recently evicted from the 2Q first-access queue */
+struct cache_ghost {
+    blkno_t blkno;                  // block number, -1 if unused
+    struct cache_ghost *hnext;      // next ghost in hash chain
+};
+
+/** definition of cache block device */
+struct cache_dev {
+    struct blkdev *dev;         // underlying block device
+    int   policy;               // write and replacement policy flags
+    int   nents;                // number of cache entries
+    struct cache_ent *ents;     // cache entries
+    int   hmask;                // hash table size - 1
+    struct cache_ent **hash;    // hash chains by block number
+    struct cache_ent lru;       // list head: lru.next is MRU, lru.prev is LRU
+    struct cache_stats stats;   // hit/miss counters
+    pthread_mutex_t lock;       // protects cache state
+
+    /* 2Q: blocks are first cached on a FIFO queue, and only move to
+     * the LRU list if accessed again after eviction from the queue */
+    struct cache_ent a1;        // list head: a1.next is newest, a1.prev is oldest
+    int   n_a1, max_a1;         // entries on and target size of a1
+    struct cache_ghost *ghosts; // FIFO ring of evicted block numbers
+    int   n_ghosts;             // size of ghost ring
+    int   next_ghost;           // next ghost slot to reuse
+    struct cache_ghost **ghash; // ghost hash chains by block number
+};
+
+/**
+ * Hash bucket index for a block number.
+ *
+ * @param cd the cache device
+ * @param blkno the block number
+ * @return the hash bucket index
+ */
+static inline int cache_hash(struct cache_dev *cd, blkno_t blkno)
+{
+    return (int)(((unsigned)(blkno ^ (blkno >> 32)) * 2654435761u) >> 7) & cd->hmask;
+}
+
+/**
+ * Remove entry from LRU list.
+ *
+ * @param e the entry
+ */
+static inline void lru_remove(struct cache_ent *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+/**
+ * Insert entry at MRU end of LRU list.
+ *
+ * @param cd the cache device
+ * @param e the entry
+ */
+static inline void lru_insert(struct cache_dev *cd, struct cache_ent *e)
+{
+    e->next = cd->lru.next;
+    e->prev = &cd->lru;
+    cd->lru.next->prev = e;
+    cd->lru.next = e;
+}
+
+/**
+ * Insert entry at LRU end of LRU list.
+ *
+ * @param cd the cache device
+ * @param e the entry
+ */
+static inline void lru_append(struct cache_dev *cd, struct cache_ent *e)
+{
+    e->prev = cd->lru.prev;
+    e->next = &cd->lru;
+    cd->lru.prev->next = e;
+    cd->lru.prev = e;
+}
+
+/**
+ * Find cached block.
+ *
+ * @param cd the cache device
+ * @param blkno the block number
+ * @return the entry or NULL if not cached
+ */
+static struct cache_ent *cache_lookup(struct cache_dev *cd, blkno_t blkno)
+{
+    struct cache_ent *e = cd->hash[cache_hash(cd, blkno)];
+    while (e != NULL && e->blkno != blkno) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+/**
+ * Remove entry from its hash chain.
+ *
+ * @param cd the cache device
+ * @param e the entry
+ */
+static void cache_unhash(struct cache_dev *cd, struct cache_ent *e)
+{
+    struct cache_ent **pp = &cd->hash[cache_hash(cd, e->blkno)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    e->hnext = NULL;
+}
+
+/**
+ * Find and forget the ghost of a block recently evicted from
+ * the 2Q first-access queue.
+ *
+ * @param cd the cache device
+ * @param blkno the block number
+ * @return 1 (true) if block had a ghost, 0 (false) otherwise
+ */
+static int ghost_remove(struct cache_dev *cd, blkno_t blkno)
+{
+    struct cache_ghost **pp = &cd->ghash[cache_hash(cd, blkno)];
+    while (*pp != NULL && (*pp)->blkno != blkno) {
+        pp = &(*pp)->hnext;
+    }
+    if (*pp == NULL) {
+        return 0;
+    }
+    struct cache_ghost *g = *pp;
+    *pp = g->hnext;
+    g->blkno = -1;
+    return 1;
+}
+
+/**
+ * Remember a block evicted from the 2Q first-access queue,
+ * replacing the oldest ghost.
+ *
+ * @param cd the cache device
+ * @param blkno the block number
+ */
+static void ghost_add(struct cache_dev *cd, blkno_t blkno)
+{
+    struct cache_ghost *g = &cd->ghosts[cd->next_ghost];
+    cd->next_ghost = (cd->next_ghost + 1) % cd->n_ghosts;
+    if (g->blkno != -1) {
+        ghost_remove(cd, g->blkno);
+    }
+    int h = cache_hash(cd, blkno);
+    g->blkno = blkno;
+    g->hnext = cd->ghash[h];
+    cd->ghash[h] = g;
+}
+
+/**
+ * Record an access to a cached block. Entries on the LRU list
+ * become most recently used; with 2Q, entries on the first-access
+ * queue stay where they are. Metadata regains its extra chance.
+ *
+ * @param cd the cache device
+ * @param e the entry
+ */
+static void cache_touch(struct cache_dev *cd, struct cache_ent *e)
+{
+    if (!e->in_a1) {
+        lru_remove(e);
+        lru_insert(cd, e);
+    }
+    e->chance = e->meta;
+}
+
+/**
+ * Choose the entry to reuse for a block not in the cache.
+ * Unused entries are taken first. With 2Q, the oldest entry on
+ * the first-access queue is taken if the queue is over its
+ * target size, and its block is remembered as a ghost.
+ * Otherwise the LRU entry is taken, except that metadata that
+ * has an extra chance is made most recently used instead.
+ *
+ * @param cd the cache device
+ * @return the entry
+ */
+static struct cache_ent *cache_victim(struct cache_dev *cd)
+{
+    struct cache_ent *e = cd->lru.prev;
+    if (e != &cd->lru && e->blkno == -1) {
+        return e;
+    }
+    if ((cd->policy & CACHE_2Q) && cd->n_a1 > 0
+        && (cd->n_a1 > cd->max_a1 || cd->lru.next == &cd->lru)) {
+        e = cd->a1.prev;
+        ghost_add(cd, e->blkno);
+        return e;
+    }
+
+    // each pass clears extra chances, so this ends
+    while ((e = cd->lru.prev)->chance) {
+        e->chance = 0;
+        lru_remove(e);
+        lru_insert(cd, e);
+    }
+    return e;
+}
+
+/**
+ * Write a dirty entry to the underlying device.
+ *
+ * @param cd the cache device
+ * @param e the entry
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_writeback(struct cache_dev *cd, struct cache_ent *e)
+{
+    int val = cd->dev->ops->write(cd->dev, e->blkno, 1, e->data);
+    if (val == SUCCESS) {
+        e->dirty = 0;
+        cd->stats.writebacks++;
+    }
+    return val;
+}
+
+/**
+ * Get an entry for a block not in the cache, evicting an entry
+ * chosen by the replacement policy and writing it back if dirty.
+ * Entry is hashed under blkno and moved to the MRU position of
+ * the LRU list. With 2Q, a block is only put on the LRU list if
+ * it was recently evicted from the first-access queue; other
+ * blocks are put on the first-access queue.
+ *
+ * @param cd the cache device
+ * @param blkno the block number
+ * @return the entry or NULL if dirty victim cannot be written
+ */
+static struct cache_ent *cache_alloc(struct cache_dev *cd, blkno_t blkno)
+{
+    struct cache_ent *e = cache_victim(cd);
+    if (e->blkno != -1) {
+        if (e->dirty && cache_writeback(cd, e) != SUCCESS) {
+            return NULL;
+        }
+        cache_unhash(cd, e);
+    }
+    e->blkno = blkno;
+    e->dirty = 0;
+    e->meta = e->chance = 0;
+    int h = cache_hash(cd, blkno);
+    e->hnext = cd->hash[h];
+    cd->hash[h] = e;
+
+    lru_remove(e);
+    cd->n_a1 -= e->in_a1;
+    e->in_a1 = (cd->policy & CACHE_2Q) && !ghost_remove(cd, blkno);
+    if (e->in_a1) {
+        // newest on first-access queue
+        e->next = cd->a1.next;
+        e->prev = &cd->a1;
+        cd->a1.next->prev = e;
+        cd->a1.next = e;
+        cd->n_a1++;
+    } else {
+        lru_insert(cd, e);
+    }
+    return e;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t cache_num_blocks(struct blkdev *dev)
+{
+    struct cache_dev *cd = dev->private;
+    return cd->dev->ops->num_blocks(cd->dev);
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ * Runs of blocks not in the cache are read from the underlying
+ * device with a single request.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct cache_dev *cd = dev->private;
+    char *p = buf;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&cd->lock);
+    for (int i = 0; i < num_blks && val == SUCCESS; ) {
+        struct cache_ent *e = cache_lookup(cd, first_blk + i);
+        if (e != NULL) {
+            // hit: copy out and record access
+            memcpy(p + i*BLOCK_SIZE, e->data, BLOCK_SIZE);
+            cache_touch(cd, e);
+            cd->stats.hits++;
+            i++;
+            continue;
+        }
+
+        // miss: read run of uncached blocks directly into buf
+        int n = 1;
+        while (i+n < num_blks && cache_lookup(cd, first_blk+i+n) == NULL) {
+            n++;
+        }
+        val = cd->dev->ops->read(cd->dev, first_blk + i, n, p + i*BLOCK_SIZE);
+        if (val == SUCCESS) {
+            cd->stats.misses += n;
+            for (int j = 0; j < n; j++) {
+                e = cache_alloc(cd, first_blk + i + j);
+                if (e != NULL) {
+                    memcpy(e->data, p + (i+j)*BLOCK_SIZE, BLOCK_SIZE);
+                }
+            }
+        }
+        i += n;
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return val;
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ * Write-through caches also write to the underlying device;
+ * write-back caches only mark the cached blocks dirty.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct cache_dev *cd = dev->private;
+    char *p = buf;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&cd->lock);
+    if (!(cd->policy & CACHE_WRITE_BACK)) {
+        val = cd->dev->ops->write(cd->dev, first_blk, num_blks, buf);
+    }
+    for (int i = 0; i < num_blks && val == SUCCESS; i++) {
+        struct cache_ent *e = cache_lookup(cd, first_blk + i);
+        if (e != NULL) {
+            cache_touch(cd, e);
+        } else if ((e = cache_alloc(cd, first_blk + i)) == NULL) {
+            // cannot make room: write this block through
+            val = cd->dev->ops->write(cd->dev, first_blk + i, 1, p + i*BLOCK_SIZE);
+            continue;
+        }
+        memcpy(e->data, p + i*BLOCK_SIZE, BLOCK_SIZE);
+        e->dirty = (cd->policy & CACHE_WRITE_BACK) != 0;
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return val;
+}
+
+/**
+ * Flush the block device. Dirty cached blocks in the range are
+ * written to the underlying device, which is then flushed.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct cache_dev *cd = dev->private;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&cd->lock);
+    for (int i = 0; i < cd->nents && val == SUCCESS; i++) {
+        struct cache_ent *e = &cd->ents[i];
+        if (e->dirty && e->blkno >= first_blk && e->blkno < first_blk+num_blks) {
+            val = cache_writeback(cd, e);
+        }
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    if (val == SUCCESS) {
+        val = cd->dev->ops->flush(cd->dev, first_blk, num_blks);
+    }
+    return val;
+}
+
+/**
+ * Discard blocks of the block device. Cached copies are dropped
+ * without being written back, and the underlying device is
+ * told to discard the blocks.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct cache_dev *cd = dev->private;
+
+    pthread_mutex_lock(&cd->lock);
+    for (int i = 0; i < cd->nents; i++) {
+        struct cache_ent *e = &cd->ents[i];
+        if (e->blkno >= first_blk && e->blkno < first_blk+num_blks) {
+            // make entry unused and least recently used
+            cache_unhash(cd, e);
+            e->blkno = -1;
+            e->dirty = e->meta = e->chance = 0;
+            lru_remove(e);
+            cd->n_a1 -= e->in_a1;
+            e->in_a1 = 0;
+            lru_append(cd, e);
+        }
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return blkdev_discard(cd->dev, first_blk, num_blks);
+}
+
+/**
+ * Mark cached blocks as file system metadata. Metadata on the
+ * LRU list gets an extra chance to stay cached each time it is
+ * accessed; with 2Q, metadata moves from the first-access queue
+ * to the LRU list.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ * @param hint BLKDEV_HINT_META
+ * @return SUCCESS
+ */
+static int cache_hint(struct blkdev *dev, blkno_t first_blk, int num_blks, int hint)
+{
+    struct cache_dev *cd = dev->private;
+    if (hint != BLKDEV_HINT_META) {
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&cd->lock);
+    for (int i = 0; i < num_blks; i++) {
+        struct cache_ent *e = cache_lookup(cd, first_blk + i);
+        if (e != NULL) {
+            e->meta = e->chance = 1;
+            if (e->in_a1) {
+                lru_remove(e);
+                e->in_a1 = 0;
+                cd->n_a1--;
+                lru_insert(cd, e);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Prefetch blocks of the block device. Runs of blocks that are
+ * not cached are prefetched by the underlying device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS
+ */
+static int cache_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct cache_dev *cd = dev->private;
+
+    for (int i = 0; i < num_blks; ) {
+        pthread_mutex_lock(&cd->lock);
+        while (i < num_blks && cache_lookup(cd, first_blk + i) != NULL) {
+            i++;
+        }
+        int n = 0;
+        while (i+n < num_blks && cache_lookup(cd, first_blk + i+n) == NULL) {
+            n++;
+        }
+        pthread_mutex_unlock(&cd->lock);
+
+        if (n > 0) {
+            blkdev_prefetch(cd->dev, first_blk + i, n);
+        }
+        i += n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close the block device. Dirty blocks are written back and
+ * the underlying device is closed.
+ *
+ * @param dev the block device
+ */
+static void cache_close(struct blkdev *dev)
+{
+    struct cache_dev *cd = dev->private;
+
+    cache_flush(dev, 0, cache_num_blocks(dev));
+    cd->dev->ops->close(cd->dev);
+
+    pthread_mutex_destroy(&cd->lock);
+    free(cd->ghash);
+    free(cd->ghosts);
+    free(cd->hash);
+    free(cd->ents);
+    free(cd);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops cache_ops = {
+    .num_blocks = cache_num_blocks,
+    .read = cache_read,
+    .write = cache_write,
+    .flush = cache_flush,
+    .close = cache_close,
+    .discard = cache_discard,
+    .hint = cache_hint,
+    .prefetch = cache_prefetch
+};
+
+/**
+ * Create a caching block device layered over an existing
+ * block device. Blocks are kept in a hash-indexed LRU cache.
+ * With CACHE_WRITE_BACK, writes are only written to the
+ * underlying device when evicted, flushed, or closed.
+ * With CACHE_2Q, blocks accessed once are kept on a separate
+ * queue of a quarter of the cache, so a scan does not evict
+ * blocks accessed repeatedly. Blocks hinted as metadata are
+ * kept in preference to file data.
+ *
+ * @param dev the underlying block device
+ * @param nblks the number of blocks to cache
+ * @param policy CACHE_WRITE_THROUGH or CACHE_WRITE_BACK,
+ *   optionally with CACHE_2Q
+ * @return the block device or NULL if cannot allocate cache
+ */
+struct blkdev *cache_create(struct blkdev *dev, int nblks, int policy)
+{
+    if (dev == NULL || nblks <= 0) {
+        return NULL;
+    }
+
+    struct blkdev *cdev = malloc(sizeof(*cdev));
+    struct cache_dev *cd = calloc(1, sizeof(*cd));
+    if (cdev == NULL || cd == NULL) {
+        free(cdev);
+        free(cd);
+        return NULL;
+    }
+
+    // hash table is a power of 2 at least as large as the cache
+    int nhash = 1;
+    while (nhash < nblks) {
+        nhash <<= 1;
+    }
+
+    cd->dev = dev;
+    cd->policy = policy;
+    cd->nents = nblks;
+    cd->hmask = nhash - 1;
+    cd->ents = calloc(nblks, sizeof(struct cache_ent));
+    cd->hash = calloc(nhash, sizeof(struct cache_ent*));
+
+    // 2Q remembers evicted blocks for half the cache size
+    cd->max_a1 = (nblks + 3) / 4;
+    cd->n_ghosts = (nblks + 1) / 2;
+    cd->ghosts = calloc(cd->n_ghosts, sizeof(struct cache_ghost));
+    cd->ghash = calloc(nhash, sizeof(struct cache_ghost*));
+    if (cd->ents == NULL || cd->hash == NULL || cd->ghosts == NULL || cd->ghash == NULL) {
+        free(cd->ghosts);
+        free(cd->ghash);
+        free(cd->ents);
+        free(cd->hash);
+        free(cd);
+        free(cdev);
+        return NULL;
+    }
+
+    for (int i = 0; i < cd->n_ghosts; i++) {
+        cd->ghosts[i].blkno = -1;
+    }
+
+    // all entries start unused on the LRU list
+    cd->a1.next = cd->a1.prev = &cd->a1;
+    cd->lru.next = cd->lru.prev = &cd->lru;
+    for (int i = 0; i < nblks; i++) {
+        cd->ents[i].blkno = -1;
+        lru_insert(cd, &cd->ents[i]);
+    }
+    pthread_mutex_init(&cd->lock, NULL);
+
+    cdev->private = cd;
+    cdev->ops = &cache_ops;
+
+    return cdev;
+}
+
+/**
+ * Get the hit/miss counters of a caching block device.
+ *
+ * @param dev the caching block device
+ * @param stats the counters returned
+ */
+void cache_get_stats(struct blkdev *dev, struct cache_stats *stats)
+{
+    struct cache_dev *cd = dev->private;
+
+    pthread_mutex_lock(&cd->lock);
+    *stats = cd->stats;
+    pthread_mutex_unlock(&cd->lock);
+}
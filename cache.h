@@ -0,0 +1,53 @@
+/*
+ * file:        cache.h
+ *
+ * description: caching block device for CS 7600 / CS 5600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "blkdev.h"
+
+/** cache write policy */
+enum {CACHE_WRITE_THROUGH = 0, CACHE_WRITE_BACK = 1};
+
+/** cache replacement policy flag: LRU if not set */
+enum {CACHE_2Q = 2};
+
+/** cache hit/miss counters */
+struct cache_stats {
+    long hits;          /* blocks found in cache */
+    long misses;        /* blocks read from underlying device */
+    long writebacks;    /* dirty blocks written to underlying device */
+};
+
+/**
+ * Create a caching block device layered over an existing
+ * block device. Blocks are kept in a hash-indexed LRU cache.
+ * With CACHE_WRITE_BACK, writes are only written to the
+ * underlying device when evicted, flushed, or closed.
+ * With CACHE_2Q, blocks accessed once are kept on a separate
+ * queue of a quarter of the cache, so a scan does not evict
+ * blocks accessed repeatedly. Blocks hinted as metadata are
+ * kept in preference to file data.
+ *
+ * @param dev the underlying block device
+ * @param nblks the number of blocks to cache
+ * @param policy CACHE_WRITE_THROUGH or CACHE_WRITE_BACK,
+ *   optionally with CACHE_2Q
+ * @return the block device or NULL if cannot allocate cache
+ */
+extern struct blkdev *cache_create(struct blkdev *dev, int nblks, int policy);
+
+/**
+ * Get the hit/miss counters of a caching block device.
+ *
+ * @param dev the caching block device
+ * @param stats the counters returned
+ */
+extern void cache_get_stats(struct blkdev *dev, struct cache_stats *stats);
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,716 @@
+/*
+ * file:        cimage.c
+ *
+ * description: compressed image block device for CS 7600 / CS 5600
+ *              file system. The image file has a header, an index
+ *              of clusters, and the compressed clusters:
+ *
+ *              +--------+-------------------+---------------------
+ *              | header | index[nclusters]  | cluster data ...
+ *              +--------+-------------------+---------------------
+ *
+ *              Clusters are compressed with a small LZ77 codec
+ *              in the style of LZ4. A rewritten cluster reuses its
+ *              space in the file if it still fits, and is
+ *              otherwise appended to the end of the file.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+#include "cimage.h"
+
+/** compressed image file magic number */
+static const char cimage_magic[8] = "FSXCIMG1";
+
+/** number of decompressed clusters kept in memory */
+enum {CIMAGE_CACHE_CLUSTERS = 64};
+
+/** compressed image file header, at offset 0 */
+struct cimage_header {
+    char     magic[8];          // cimage_magic
+    uint32_t cluster_blks;      // blocks per cluster
+    uint32_t nclusters;         // number of clusters
+    uint64_t nblks;             // number of blocks in device
+    uint64_t index_off;         // file offset of cluster index
+};
+
+/** cluster index entry */
+struct cimage_index {
+    uint64_t off;               // file offset of cluster data
+    uint32_t len;               // compressed length, 0 if cluster is 0s
+    uint32_t alloc;             // bytes reserved at off
+};
+
+/** decompressed cluster in memory */
+struct cimage_cluster {
+    int   cno;                  // cluster number, -1 if unused
+    int   dirty;                // 1 if modified since written
+    long  used;                 // time of last use, for LRU
+    char *data;                 // cluster content
+};
+
+/** definition of compressed image block device */
+struct cimage_dev {
+    char *path;                 // path to image file
+    int   fd;                   // file descriptor of open file
+    struct cimage_header hdr;   // file header
+    struct cimage_index *index; // cluster index
+    int   index_dirty;          // 1 if index modified since written
+    off_t end;                  // end of file, where clusters are appended
+    int   csize;                // cluster size in bytes
+    char *zbuf;                 // compressed cluster buffer
+    long  clock;                // use counter for LRU
+    struct cimage_cluster cache[CIMAGE_CACHE_CLUSTERS];
+    pthread_mutex_t lock;       // protects device state
+};
+
+/* LZ codec: a sequence is a token byte holding the literal length
+ * in the high 4 bits and match length - 4 in the low 4 bits, each
+ * extended by bytes of 255 while 15, then the literals, then a
+ * 2-byte match offset. The last sequence has only literals.
+ */
+enum {LZ_MIN_MATCH = 4, LZ_HASH_BITS = 12, LZ_MAX_OFFSET = 65535};
+
+/**
+ * Read 4 unaligned bytes.
+ */
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Write a length extension: bytes of 255 and the remainder.
+ *
+ * @param op the output position
+ * @param len the length beyond 15
+ * @return the output position after the extension
+ */
+static uint8_t *lz_put_len(uint8_t *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Compress a buffer.
+ *
+ * @param src the buffer
+ * @param n the length of the buffer
+ * @param dst the compressed output
+ * @param cap the capacity of the output
+ * @return the compressed length, or -1 if it would exceed cap
+ */
+static int lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    // worst case: each sequence adds at most a few bytes per 255 literals
+    uint8_t *op = dst, *oend = dst + cap;
+    int anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t h = (lz_read32(src+i) * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h];
+        table[h] = i;
+        if (cand < 0 || i - cand > LZ_MAX_OFFSET || lz_read32(src+cand) != lz_read32(src+i)) {
+            i++;
+            continue;
+        }
+        int mlen = LZ_MIN_MATCH;
+        while (i + mlen < n && src[cand+mlen] == src[i+mlen]) {
+            mlen++;
+        }
+
+        // token, literals, offset, match length
+        int lit = i - anchor;
+        if (op + 1 + lit/255 + 1 + lit + 2 + (mlen - LZ_MIN_MATCH)/255 + 1 > oend) {
+            return -1;
+        }
+        uint8_t *token = op++;
+        *token = ((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) {
+            op = lz_put_len(op, lit - 15);
+        }
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        int off = i - cand;
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        int m = mlen - LZ_MIN_MATCH;
+        *token |= (m < 15 ? m : 15);
+        if (m >= 15) {
+            op = lz_put_len(op, m - 15);
+        }
+        i += mlen;
+        anchor = i;
+    }
+
+    // final literals
+    int lit = n - anchor;
+    if (op + 1 + lit/255 + 1 + lit > oend) {
+        return -1;
+    }
+    *op++ = ((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) {
+        op = lz_put_len(op, lit - 15);
+    }
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/**
+ * Decompress a buffer.
+ *
+ * @param src the compressed input
+ * @param n the length of the input
+ * @param dst the output
+ * @param cap the expected length of the output
+ * @return SUCCESS if output has length cap, E_SIZE if input is corrupt
+ */
+static int lz_decompress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        int token = *ip++;
+
+        // literals
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do {
+                if (ip >= iend) {
+                    return E_SIZE;
+                }
+                lit += (b = *ip++);
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) {
+            return E_SIZE;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;      // last sequence
+        }
+
+        // match, which may overlap its output
+        if (iend - ip < 2) {
+            return E_SIZE;
+        }
+        int off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int b;
+            do {
+                if (ip >= iend) {
+                    return E_SIZE;
+                }
+                mlen += (b = *ip++);
+            } while (b == 255);
+        }
+        if (off == 0 || off > op - dst || mlen > oend - op) {
+            return E_SIZE;
+        }
+        for (const uint8_t *mp = op - off; mlen > 0; mlen--) {
+            *op++ = *mp++;
+        }
+    }
+    return (op == oend) ? SUCCESS : E_SIZE;
+}
+
+/**
+ * Compress a cluster and write it to the image file. Clusters
+ * of 0s are not written. Clusters that do not compress are
+ * stored as is, with len equal to the cluster size.
+ *
+ * @param cd the compressed image device
+ * @param cno the cluster number
+ * @param data the cluster content
+ * @return SUCCESS if successful, E_UNAVAIL if cannot write
+ */
+static int cimage_put(struct cimage_dev *cd, int cno, const char *data)
+{
+    struct cimage_index *ix = &cd->index[cno];
+
+    int zero = 1;
+    for (int i = 0; i < cd->csize && zero; i++) {
+        zero = (data[i] == 0);
+    }
+    int len = 0;
+    const char *out = cd->zbuf;
+    if (!zero) {
+        len = lz_compress((const uint8_t*)data, cd->csize, (uint8_t*)cd->zbuf, cd->csize - 1);
+        if (len < 0) {
+            len = cd->csize;
+            out = data;
+        }
+    }
+
+    // reuse reserved space if it fits, otherwise append
+    if ((uint32_t)len > ix->alloc) {
+        ix->off = cd->end;
+        ix->alloc = (len + 511) & ~511;
+        cd->end += ix->alloc;
+    }
+    if (len > 0 && pwrite(cd->fd, out, len, ix->off) != len) {
+        fprintf(stderr, "write error on %s: %s\n", cd->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    ix->len = len;
+    cd->index_dirty = 1;
+    return SUCCESS;
+}
+
+/**
+ * Read and decompress a cluster from the image file.
+ *
+ * @param cd the compressed image device
+ * @param cno the cluster number
+ * @param data the cluster content
+ * @return SUCCESS if successful, E_UNAVAIL if cannot read or corrupt
+ */
+static int cimage_get(struct cimage_dev *cd, int cno, char *data)
+{
+    struct cimage_index *ix = &cd->index[cno];
+    if (ix->len == 0) {
+        memset(data, 0, cd->csize);
+        return SUCCESS;
+    }
+    char *in = (ix->len == (uint32_t)cd->csize) ? data : cd->zbuf;
+    if (ix->len > (uint32_t)cd->csize
+        || pread(cd->fd, in, ix->len, ix->off) != (ssize_t)ix->len) {
+        fprintf(stderr, "read error on %s: %s\n", cd->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    if (in != data
+        && lz_decompress((uint8_t*)in, ix->len, (uint8_t*)data, cd->csize) != SUCCESS) {
+        fprintf(stderr, "corrupt cluster %d in %s\n", cno, cd->path);
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Get a cluster in memory, evicting the least recently used
+ * cluster and writing it back if modified.
+ *
+ * @param cd the compressed image device
+ * @param cno the cluster number
+ * @param load 0 if the whole cluster will be overwritten
+ * @return the cluster or NULL if cannot read or write back
+ */
+static struct cimage_cluster *cimage_cluster(struct cimage_dev *cd, int cno, int load)
+{
+    struct cimage_cluster *c = &cd->cache[0];
+    for (int i = 0; i < CIMAGE_CACHE_CLUSTERS; i++) {
+        if (cd->cache[i].cno == cno) {
+            c = &cd->cache[i];
+            c->used = ++cd->clock;
+            return c;
+        }
+        if (cd->cache[i].used < c->used) {
+            c = &cd->cache[i];
+        }
+    }
+
+    if (c->cno != -1 && c->dirty) {
+        if (cimage_put(cd, c->cno, c->data) != SUCCESS) {
+            return NULL;
+        }
+    }
+    c->cno = -1;
+    c->dirty = 0;
+    if (load && cimage_get(cd, cno, c->data) != SUCCESS) {
+        return NULL;
+    }
+    c->cno = cno;
+    c->used = ++cd->clock;
+    return c;
+}
+
+/**
+ * Write the header and cluster index to the image file.
+ *
+ * @param cd the compressed image device
+ * @return SUCCESS if successful, E_UNAVAIL if cannot write
+ */
+static int cimage_write_index(struct cimage_dev *cd)
+{
+    size_t len = (size_t)cd->hdr.nclusters * sizeof(struct cimage_index);
+    if (pwrite(cd->fd, &cd->hdr, sizeof(cd->hdr), 0) != sizeof(cd->hdr)
+        || pwrite(cd->fd, cd->index, len, cd->hdr.index_off) != (ssize_t)len) {
+        fprintf(stderr, "write error on %s: %s\n", cd->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    cd->index_dirty = 0;
+    return SUCCESS;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t cimage_num_blocks(struct blkdev *dev)
+{
+    struct cimage_dev *cd = dev->private;
+    return cd->hdr.nblks;
+}
+
+/**
+ * Read or write blocks, one cluster at a time.
+ *
+ * @param dev the block device
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ * @param buf the buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot read or write image file
+ */
+static int cimage_xfer(struct blkdev *dev, int op, blkno_t first_blk, int num_blks, char *buf)
+{
+    struct cimage_dev *cd = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)cd->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    int cblks = cd->hdr.cluster_blks;
+    int val = SUCCESS;
+    pthread_mutex_lock(&cd->lock);
+    for (blkno_t blk = first_blk; blk < first_blk + num_blks && val == SUCCESS; ) {
+        int off = blk % cblks;
+        int n = cblks - off;
+        if (n > first_blk + num_blks - blk) {
+            n = first_blk + num_blks - blk;
+        }
+        int load = (op == BLKDEV_READ || n < cblks);
+        struct cimage_cluster *c = cimage_cluster(cd, blk / cblks, load);
+        if (c == NULL) {
+            val = E_UNAVAIL;
+            break;
+        }
+        char *p = buf + (size_t)(blk - first_blk) * BLOCK_SIZE;
+        char *q = c->data + (size_t)off * BLOCK_SIZE;
+        if (op == BLKDEV_READ) {
+            memcpy(p, q, (size_t)n * BLOCK_SIZE);
+        } else {
+            memcpy(q, p, (size_t)n * BLOCK_SIZE);
+            c->dirty = 1;
+        }
+        blk += n;
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return val;
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot read image file
+ */
+static int cimage_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return cimage_xfer(dev, BLKDEV_READ, first_blk, num_blks, buf);
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot write image file
+ */
+static int cimage_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return cimage_xfer(dev, BLKDEV_WRITE, first_blk, num_blks, buf);
+}
+
+/**
+ * Flush the block device. All modified clusters are compressed
+ * and written, then the index, and the file is synced.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if cannot write image file
+ */
+static int cimage_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct cimage_dev *cd = dev->private;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&cd->lock);
+    for (int i = 0; i < CIMAGE_CACHE_CLUSTERS && val == SUCCESS; i++) {
+        struct cimage_cluster *c = &cd->cache[i];
+        if (c->cno != -1 && c->dirty) {
+            if ((val = cimage_put(cd, c->cno, c->data)) == SUCCESS) {
+                c->dirty = 0;
+            }
+        }
+    }
+    if (val == SUCCESS && cd->index_dirty) {
+        val = cimage_write_index(cd);
+    }
+    if (val == SUCCESS && fdatasync(cd->fd) < 0) {
+        fprintf(stderr, "sync error on %s: %s\n", cd->path, strerror(errno));
+        val = E_UNAVAIL;
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return val;
+}
+
+/**
+ * Discard blocks of the block device. Whole clusters become
+ * clusters of 0s that take no space; blocks of partly
+ * discarded clusters are set to 0s.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot read or write image file
+ */
+static int cimage_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct cimage_dev *cd = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)cd->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    int cblks = cd->hdr.cluster_blks;
+    int val = SUCCESS;
+    pthread_mutex_lock(&cd->lock);
+    for (blkno_t blk = first_blk; blk < first_blk + num_blks && val == SUCCESS; ) {
+        int cno = blk / cblks;
+        int off = blk % cblks;
+        int n = cblks - off;
+        if (n > first_blk + num_blks - blk) {
+            n = first_blk + num_blks - blk;
+        }
+        if (n == cblks) {
+            // drop cached copy and mark cluster all 0s
+            for (int i = 0; i < CIMAGE_CACHE_CLUSTERS; i++) {
+                if (cd->cache[i].cno == cno) {
+                    cd->cache[i].cno = -1;
+                    cd->cache[i].dirty = 0;
+                    cd->cache[i].used = 0;
+                }
+            }
+            cd->index[cno].len = 0;
+            cd->index_dirty = 1;
+        } else {
+            struct cimage_cluster *c = cimage_cluster(cd, cno, 1);
+            if (c == NULL) {
+                val = E_UNAVAIL;
+                break;
+            }
+            memset(c->data + (size_t)off * BLOCK_SIZE, 0, (size_t)n * BLOCK_SIZE);
+            c->dirty = 1;
+        }
+        blk += n;
+    }
+    pthread_mutex_unlock(&cd->lock);
+
+    return val;
+}
+
+/**
+ * Close the block device, writing modified clusters and index.
+ *
+ * @param dev the block device
+ */
+static void cimage_close(struct blkdev *dev)
+{
+    struct cimage_dev *cd = dev->private;
+
+    cimage_flush(dev, 0, cd->hdr.nblks);
+    close(cd->fd);
+    for (int i = 0; i < CIMAGE_CACHE_CLUSTERS; i++) {
+        free(cd->cache[i].data);
+    }
+    pthread_mutex_destroy(&cd->lock);
+    free(cd->zbuf);
+    free(cd->index);
+    free(cd->path);
+    free(cd);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops cimage_ops = {
+    .num_blocks = cimage_num_blocks,
+    .read = cimage_read,
+    .write = cimage_write,
+    .flush = cimage_flush,
+    .close = cimage_close,
+    .discard = cimage_discard
+};
+
+/**
+ * Determines whether a file is a compressed image.
+ *
+ * @param path the path to the file
+ * @return 1 (true) if a compressed image, 0 (false) otherwise
+ */
+int cimage_detect(char *path)
+{
+    char magic[sizeof(cimage_magic)];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int n = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return n == sizeof(magic) && memcmp(magic, cimage_magic, sizeof(magic)) == 0;
+}
+
+/**
+ * Create a block device reading from a compressed image file.
+ * Blocks are stored in clusters, each compressed separately
+ * and found through an index in the file. Recently used
+ * clusters are kept decompressed in memory; modified clusters
+ * are compressed and written back when evicted or flushed.
+ *
+ * @param path the path to the compressed image file
+ * @return the block device or NULL if cannot open or read image file
+ */
+struct blkdev *cimage_create(char *path)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct cimage_dev *cd = calloc(1, sizeof(*cd));
+    if (dev == NULL || cd == NULL) {
+        return NULL;
+    }
+    cd->path = strdup(path);    /* save a copy for error reporting */
+
+    struct stat sb;
+    if ((cd->fd = open(path, O_RDWR)) < 0 || fstat(cd->fd, &sb) < 0) {
+        fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (pread(cd->fd, &cd->hdr, sizeof(cd->hdr), 0) != sizeof(cd->hdr)
+        || memcmp(cd->hdr.magic, cimage_magic, sizeof(cimage_magic)) != 0
+        || cd->hdr.cluster_blks == 0
+        || cd->hdr.nclusters != (cd->hdr.nblks + cd->hdr.cluster_blks - 1) / cd->hdr.cluster_blks) {
+        fprintf(stderr, "bad compressed image %s\n", path);
+        return NULL;
+    }
+    cd->end = sb.st_size;
+    cd->csize = cd->hdr.cluster_blks * BLOCK_SIZE;
+
+    // read cluster index
+    size_t len = (size_t)cd->hdr.nclusters * sizeof(struct cimage_index);
+    cd->index = malloc(len);
+    cd->zbuf = malloc(cd->csize);
+    if (cd->index == NULL || cd->zbuf == NULL
+        || pread(cd->fd, cd->index, len, cd->hdr.index_off) != (ssize_t)len) {
+        fprintf(stderr, "can't read index of %s\n", path);
+        return NULL;
+    }
+
+    for (int i = 0; i < CIMAGE_CACHE_CLUSTERS; i++) {
+        cd->cache[i].cno = -1;
+        if ((cd->cache[i].data = malloc(cd->csize)) == NULL) {
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&cd->lock, NULL);
+
+    dev->private = cd;
+    dev->ops = &cimage_ops;
+
+    return dev;
+}
+
+/**
+ * Write the content of a block device to a new compressed
+ * image file. Clusters of 0s take no space in the file.
+ *
+ * @param src the block device to copy
+ * @param path the path to the compressed image file
+ * @param cluster_blks the number of blocks in a cluster
+ * @return SUCCESS if successful, E_UNAVAIL if cannot read or write
+ */
+int cimage_convert(struct blkdev *src, char *path, int cluster_blks)
+{
+    struct cimage_dev cd;
+    memset(&cd, 0, sizeof(cd));
+    cd.path = path;
+    cd.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (cd.fd < 0) {
+        fprintf(stderr, "can't create image %s: %s\n", path, strerror(errno));
+        return E_UNAVAIL;
+    }
+
+    blkno_t nblks = src->ops->num_blocks(src);
+    memcpy(cd.hdr.magic, cimage_magic, sizeof(cimage_magic));
+    cd.hdr.cluster_blks = cluster_blks;
+    cd.hdr.nblks = nblks;
+    cd.hdr.nclusters = (nblks + cluster_blks - 1) / cluster_blks;
+    cd.hdr.index_off = BLOCK_SIZE;
+    cd.csize = cluster_blks * BLOCK_SIZE;
+
+    // cluster data starts at the block following the index
+    size_t len = (size_t)cd.hdr.nclusters * sizeof(struct cimage_index);
+    cd.end = (cd.hdr.index_off + len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    cd.index = calloc(cd.hdr.nclusters, sizeof(struct cimage_index));
+    cd.zbuf = malloc(cd.csize);
+    char *data = calloc(1, cd.csize);
+
+    int val = (cd.index && cd.zbuf && data) ? SUCCESS : E_UNAVAIL;
+    for (int cno = 0; cno < (int)cd.hdr.nclusters && val == SUCCESS; cno++) {
+        blkno_t first = (blkno_t)cno * cluster_blks;
+        int n = (nblks - first < cluster_blks) ? nblks - first : cluster_blks;
+        memset(data, 0, cd.csize);
+        if ((val = src->ops->read(src, first, n, data)) == SUCCESS) {
+            val = cimage_put(&cd, cno, data);
+        }
+    }
+    if (val == SUCCESS) {
+        val = cimage_write_index(&cd);
+    }
+    if (val == SUCCESS && fsync(cd.fd) < 0) {
+        val = E_UNAVAIL;
+    }
+    close(cd.fd);
+    free(data);
+    free(cd.zbuf);
+    free(cd.index);
+    return val;
+}
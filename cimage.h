@@ -0,0 +1,49 @@
+/*
+ * file:        cimage.h
+ *
+ * description: compressed image block device for CS 7600 / CS 5600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef CIMAGE_H_
+#define CIMAGE_H_
+
+#include "blkdev.h"
+
+/** default number of blocks in a compressed cluster */
+enum {CIMAGE_CLUSTER_BLKS = 16};
+
+/**
+ * Determines whether a file is a compressed image.
+ *
+ * @param path the path to the file
+ * @return 1 (true) if a compressed image, 0 (false) otherwise
+ */
+extern int cimage_detect(char *path);
+
+/**
+ * Create a block device reading from a compressed image file.
+ * Blocks are stored in clusters, each compressed separately
+ * and found through an index in the file. Recently used
+ * clusters are kept decompressed in memory; modified clusters
+ * are compressed and written back when evicted or flushed.
+ *
+ * @param path the path to the compressed image file
+ * @return the block device or NULL if cannot open or read image file
+ */
+extern struct blkdev *cimage_create(char *path);
+
+/**
+ * Write the content of a block device to a new compressed
+ * image file. Clusters of 0s take no space in the file.
+ *
+ * @param src the block device to copy
+ * @param path the path to the compressed image file
+ * @param cluster_blks the number of blocks in a cluster
+ * @return SUCCESS if successful, E_UNAVAIL if cannot read or write
+ */
+extern int cimage_convert(struct blkdev *src, char *path, int cluster_blks);
+
+#endif /* CIMAGE_H_ */
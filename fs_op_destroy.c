@@ -0,0 +1,41 @@
+/*
+ * fs_op_destroy.c
+ *
+ * description: destroy function for CS 5600 / 7600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <fuse.h>
+
+#include "fs_util_file.h"
+#include "fs_util_meta.h"
+#include "fs_util_readahead.h"
+#include "fs_util_vol.h"
+#include "blkdev.h"
+
+/**
+ * destroy - this is called once by the FUSE framework at unmount.
+ *
+ * Writes out any dirty metadata, then flushes and closes the
+ * block device.
+ *
+ * @param private_data unused
+ */
+void fs_destroy(void* private_data)
+{
+    // wait for and release readahead buffers
+    destroy_read_ahead();
+
+    // allocate and write blocks buffered by writes
+    flush_all_files();
+
+    // write any remaining dirty metadata blocks
+    flush_metadata();
+
+    // flush blocks held by the device and release it
+    disk->ops->flush(disk, 0, disk->ops->num_blocks(disk));
+    disk->ops->close(disk);
+    disk = NULL;
+}
@@ -0,0 +1,85 @@
+/*
+ * fs_op_fsync.c
+ *
+ * description: fs_fsync function for CS 5600 / 7600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fuse.h>
+
+#include "fs_util_file.h"
+#include "fs_util_meta.h"
+#include "fs_util_vol.h"
+#include "blkbuf.h"
+#include "blkdev.h"
+
+/**
+ * Determines whether metadata must be written for the data of
+ * an inode to be read back: blocks were allocated or freed, or
+ * the size differs from the inode on disk. Other inode fields,
+ * such as times, are not needed.
+ *
+ * @param inum the inode number
+ * @return 1 (true) or 0 (false)
+ */
+static int data_meta_dirty(int inum)
+{
+    // allocation maps and group descriptors precede the inodes
+    for (blkno_t i = 0; i < fs.inode_base; i++) {
+        if (fs.dirty[i] != NULL) {
+            return 1;
+        }
+    }
+
+    long n = inum / INODES_PER_BLK;
+    if (fs.dirty[fs.inode_base + n] == NULL) {
+        return 0;
+    }
+    struct fs_inode *blk = blkbuf_alloc(1);
+    if (blk == NULL
+        || disk->ops->read(disk, meta_blkno(fs.inode_base + n), 1, blk) < 0) {
+        blkbuf_free(blk, 1);
+        return 1;
+    }
+    int dirty = blk[inum % INODES_PER_BLK].size != fs.inodes[inum].size;
+    blkbuf_free(blk, 1);
+    return dirty;
+}
+
+/**
+ * fsync - make file contents and metadata durable.
+ *
+ * Allocates and writes blocks buffered by writes to the file,
+ * writes out dirty metadata and flushes the block device.
+ * Concurrent callers share one device sync. Without a file
+ * handle, the buffered blocks of all files are written.
+ *
+ * Errors:
+ *   -ENOSPC  - no space to allocate buffered blocks
+ *   -EIO     - error flushing block device
+ *
+ * @param path the file path
+ * @param datasync if non-zero, metadata is written only if
+ *   it is needed to read back the file data
+ * @param fi the fuse file info, or NULL
+ * @return 0 if successful, or -error number
+ */
+int fs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    // allocate and write blocks buffered by writes
+    int val = (fi != NULL) ? flush_file(fi->fh) : flush_all_files();
+
+    // write any remaining dirty metadata blocks
+    if (!datasync || fi == NULL || data_meta_dirty(fi->fh)) {
+        flush_metadata();
+    }
+
+    // make all blocks written so far durable
+    if (disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) {
+        return -EIO;
+    }
+    return val;
+}
@@ -8,15 +8,41 @@
  * Philip Gust, March 2019, March 2020
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <fuse.h>
 
+#include "fs_util_meta.h"
 #include "fs_util_vol.h"
 #include "blkdev.h"
 
 /** Instance of ex2 fs structure */
 struct ext2_fs fs;
 
+/**
+ * Read consecutive metadata blocks. Without block groups they
+ * are consecutive on the device, and are read with one request.
+ *
+ * @param first the metadata block number of first block
+ * @param n the number of blocks
+ * @param buf the buffer for the blocks
+ * @return SUCCESS or block device error
+ */
+static int read_meta(blkno_t first, blkno_t n, void *buf)
+{
+    if (fs.n_groups == 0) {
+        return disk->ops->read(disk, first, n, buf);
+    }
+    for (blkno_t i = 0; i < n; i++) {
+        int val = disk->ops->read(disk, meta_blkno(first + i), 1,
+                                  (char*)buf + i*FS_BLOCK_SIZE);
+        if (val < 0) {
+            return val;
+        }
+    }
+    return SUCCESS;
+}
+
 /**
  * init - this is called once by the FUSE framework at startup.
  *
@@ -38,35 +64,66 @@ void* fs_init(struct fuse_conn_info* conn)
     // record root inode
     fs.root_inode = sb.root_inode;
 
-    /* The inode map and block map are written directly to the disk after the superblock */
+    /* The group descriptors, if any, follow the superblock. The inode map,
+     * block map and inode blocks are next, or are in their groups. */
+    fs.n_groups = 0;
+    fs.inode_map_base = 1;
+    if (sb.blocks_per_group != 0) {
+        fs.n_groups = sb.inode_map_sz;  // one inode map block per group
+        fs.blocks_per_group = sb.blocks_per_group;
+        fs.inodes_per_group = sb.inodes_per_group;
+        fs.inode_map_base += sb.group_desc_sz;
+    }
+    fs.block_map_base = fs.inode_map_base + sb.inode_map_sz;
+    fs.inode_base = fs.block_map_base + sb.block_map_sz;
+
+    // read group descriptors
+    if (fs.n_groups > 0) {
+        fs.groups = malloc((size_t)sb.group_desc_sz * FS_BLOCK_SIZE);
+        if (read_meta(1, sb.group_desc_sz, fs.groups) < 0) {
+            exit(1);
+        }
+    }
 
     // read inode map
-    fs.inode_map_base = 1;
-    fs.inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, fs.inode_map_base, sb.inode_map_sz, fs.inode_map) < 0) {
+    fs.inode_map = malloc((size_t)sb.inode_map_sz * FS_BLOCK_SIZE);
+    if (read_meta(fs.inode_map_base, sb.inode_map_sz, fs.inode_map) < 0) {
         exit(1);
     }
 
     // read block map
-    fs.block_map_base = fs.inode_map_base + sb.inode_map_sz;
-    fs.block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, fs.block_map_base, sb.block_map_sz, fs.block_map) < 0) {
+    fs.block_map = malloc((size_t)sb.block_map_sz * FS_BLOCK_SIZE);
+    if (read_meta(fs.block_map_base, sb.block_map_sz, fs.block_map) < 0) {
         exit(1);
     }
 
-    /* The inode data is written to the next set of blocks */
-    fs.inode_base = fs.block_map_base + sb.block_map_sz;
+    // read inode blocks
     fs.n_inodes = sb.inode_region_sz * INODES_PER_BLK;
-    fs.inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, fs.inode_base, sb.inode_region_sz, fs.inodes) < 0) {
+    fs.inodes = malloc((size_t)sb.inode_region_sz * FS_BLOCK_SIZE);
+    if (read_meta(fs.inode_base, sb.inode_region_sz, fs.inodes) < 0) {
         exit(1);
     }
+    fs.inode_map_bits = (fs.n_groups > 0) ? (int64_t)fs.n_groups * BITS_PER_BLK
+                                          : fs.n_inodes;
 
     // number of metadata blocks
     fs.n_meta = fs.inode_base + sb.inode_region_sz;
 
+    // start free inode and block searches at the first candidates
+    fs.inode_cursor = 0;
+    fs.block_cursor = (fs.n_groups > 0) ? 0 : fs.n_meta;
+
     // number of blocks on device
     fs.n_blocks = sb.num_blocks;
+    if (fs.n_blocks > disk->ops->num_blocks(disk)) {
+        fprintf(stderr, "file system has %lld blocks but device has %lld\n",
+                (long long)fs.n_blocks, (long long)disk->ops->num_blocks(disk));
+        exit(1);
+    }
+
+    // count free inodes and blocks once; allocation keeps the counts
+    fs.n_inodes_free = (int)bit_count_clear(fs.inode_map, fs.inode_map_bits);
+    fs.n_blocks_free = bit_count_clear(fs.block_map, fs.n_blocks);
 
     // allocate dirty metadata blocks
     fs.dirty = calloc(fs.n_meta, sizeof(void*));  // ptrs to dirty metadata blks
@@ -49,7 +49,7 @@ int fs_link(const char* path1, const char* path2)
     struct fs_inode *din = &fs.inodes[target_dir_inum];
 
     // get directory entry set
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
     get_dir_entry_block(target_dir_inum, buf, &blkno, newName);
 
@@ -15,6 +15,7 @@
 
 #include "fs_util_file.h"
 #include "fs_util_path.h"
+#include "fs_util_readahead.h"
 #include "fs_util_vol.h"
 #include "blkdev.h"
 
@@ -62,8 +63,9 @@ int fs_read(const char* path, char* buf, size_t len, off_t offset,
     	return -EISDIR;
     }
 
-    // read bytes of inode
-    int nread = do_read(inum, buf, len, offset);
+    // read bytes of inode, with readahead if file is open
+    int nread = (fi != NULL) ? do_read_ahead(inum, buf, len, offset)
+                             : do_read(inum, buf, len, offset);
     return nread;
 }
 
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <fuse.h>
 
+#include "fs_util_dir.h"
 #include "fs_util_file.h"
 #include "fs_util_path.h"
 #include "fs_util_vol.h"
@@ -60,10 +61,11 @@ int fs_readdir(const char* path, void *ptr, fuse_fill_dir_t filler,
     }
 
     // process each directory entry
+    prefetch_dir_blks(inum);
     for (int blkindex = 0; ; blkindex++) {
     	// get block no of n-th directory block
         char buf[FS_BLOCK_SIZE];
-        int blkno = get_file_blk(inum, blkindex, buf, 0);
+        blkno_t blkno = get_file_blk(inum, blkindex, buf, 0);
         if (blkno == 0) {
         	break;
         } else if (blkno < 0) {
@@ -11,10 +11,15 @@
 #include <stdlib.h>
 #include <fuse.h>
 
+#include "fs_util_file.h"
+#include "fs_util_readahead.h"
+
 /**
- * Release resources created by pending open call.
+ * Release resources created by pending open call, and
+ * allocate and write blocks buffered by writes to the file.
  *
  * Errors:
+ *   -ENOSPC  - no space to allocate buffered blocks
  *   -ENOENT  - file does not exist
  *   -ENOTDIR - component of path not a directory
  *
@@ -24,9 +29,12 @@
  */
 int fs_release(const char* path, struct fuse_file_info* fi)
 {
+	int val = 0;
 	if (fi != NULL) {
+		release_read_ahead(fi->fh);  // drop prefetched blocks
+		val = flush_file(fi->fh);  // allocate and write buffered blocks
 		fi->fh = 0;  // remove saved inode number
 	}
-    return 0;
+    return val;
 }
 
@@ -65,7 +65,7 @@ int fs_rename(const char* src_path, const char* dst_path)
     struct fs_inode *din = &fs.inodes[srcdir_inum];
 
     /* find source directory entry */
-    int s_blkno;
+    blkno_t s_blkno;
     struct fs_dirent s_de[DIRENTS_PER_BLK];
     int s_dirno = get_dir_entry_block(srcdir_inum, s_de, &s_blkno, src_leaf);
     if (s_dirno < 0) {
@@ -73,7 +73,7 @@ int fs_rename(const char* src_path, const char* dst_path)
     }
 
     /* check target directory entry */
-    int t_blkno;
+    blkno_t t_blkno;
     struct fs_dirent t_de[DIRENTS_PER_BLK];
     int t_dirno = get_dir_entry_block(dstdir_inum, t_de, &t_blkno, dst_leaf);
     // if target exists, check the type and unlink it
@@ -9,7 +9,6 @@
  */
 
 #include <errno.h>
-#include <sys/select.h>
 
 #include "fs_util_dir.h"
 #include "fs_util_file.h"
@@ -49,7 +48,7 @@ int fs_rmdir(const char* path)
 
 
     /** find entry in directory */
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
     int entno = get_dir_entry_block(dir_inum, buf, &blkno, leaf);
     if (entno < 0) {
@@ -39,26 +39,12 @@ int fs_statfs(const char* path, struct statvfs* st)
      */
 	memset(st, 0, sizeof(statvfs));
 
-	// compute number of free blocks
-	int n_blocks_free = 0;
-	for (int i = 0; i < fs.n_blocks; i++) {
-		if (is_free_blk(i)) n_blocks_free++;
-	}
-
-	// compute number of free inodes
-	int n_inodes_free = 0;
-	for (int i = 0; i < fs.n_inodes; i++) {
-		if (is_free_inode(i)) {
-			n_inodes_free++;
-		}
-	}
-
 	st->f_bsize = FS_BLOCK_SIZE;
     st->f_blocks = fs.n_blocks;
-    st->f_bfree = n_blocks_free;
+    st->f_bfree = fs.n_blocks_free - fs.n_blocks_delayed;
     st->f_bavail = st->f_bfree;
     st->f_files = fs.n_inodes;
-    st->f_ffree = n_inodes_free;
+    st->f_ffree = fs.n_inodes_free;
     st->f_favail = st->f_ffree;
     st->f_namemax = FS_FILENAME_SIZE-1;
 
@@ -10,7 +10,6 @@
 
 #include <unistd.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 
 #include "fs_util_file.h"
@@ -48,7 +48,7 @@ int fs_unlink(const char* path)
 
 
     /* find directory entry block and index */
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
     int entno = get_dir_entry_block(dir_inum, buf, &blkno, leaf);
     if (entno < 0) {
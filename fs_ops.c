@@ -18,6 +18,8 @@
  */
 struct fuse_operations fs_ops = {
     .chmod = fs_chmod,
+    .destroy = fs_destroy,
+    .fsync = fs_fsync,
     .getattr = fs_getattr,
     .init = fs_init,
     .mkdir = fs_mkdir,
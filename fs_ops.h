@@ -75,6 +75,22 @@ int fs_symlink(const char* path1, const char* path2);
  */
 int fs_chmod(const char* path, mode_t mode);
 
+/**
+ * fsync - make file contents and metadata durable.
+ *
+ * Writes out dirty metadata and flushes the block device.
+ * Concurrent callers share one device sync.
+ *
+ * Errors:
+ *   -EIO     - error flushing block device
+ *
+ * @param path the file path
+ * @param datasync unused - metadata is always flushed
+ * @param fi the fuse file info
+ * @return 0 if successful, or -error number
+ */
+int fs_fsync(const char* path, int datasync, struct fuse_file_info* fi);
+
 /**
  * getattr - get file or directory attributes. For a description of
  * the fields in 'struct stat', see 'man lstat'.
@@ -105,6 +121,16 @@ int fs_getattr(const char* path, struct stat *sb);
  */
 void* fs_init(struct fuse_conn_info* conn);
 
+/**
+ * destroy - this is called once by the FUSE framework at unmount.
+ *
+ * Writes out any dirty metadata, then flushes and closes the
+ * block device.
+ *
+ * @param private_data unused
+ */
+void fs_destroy(void* private_data);
+
 /**
  *  mkdir - create a directory with the given mode. Behavior
  *  undefined when mode bits other than the low 9 bits are used.
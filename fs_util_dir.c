@@ -48,7 +48,7 @@ int is_dir_empty(int inum)
     }
 
     // read first directory block for inode
-    int blkno = get_file_blkno(inum, 0, 0);
+    blkno_t blkno = get_file_blkno(inum, 0, 0);
     // empty if not present
     if (blkno == 0) {
     	return 1;
@@ -100,6 +100,39 @@ int get_free_entry_in_block(struct fs_dirent* de) {
     return -ENOSPC;
 }
 
+/** maximum number of directory blocks prefetched by a scan */
+enum {DIR_PREFETCH_BLKS = 64};
+
+/**
+ * Prefetch the blocks of a directory before scanning it, so
+ * the device reads them while earlier blocks are searched.
+ * Runs of adjacent blocks are prefetched together. Nothing is
+ * prefetched for a directory of a single block.
+ *
+ * @param inum the inode number of a directory
+ */
+void prefetch_dir_blks(int inum)
+{
+    blkno_t blknos[DIR_PREFETCH_BLKS];
+    int nblks = 0;
+    while (nblks < DIR_PREFETCH_BLKS
+           && (blknos[nblks] = get_file_blkno(inum, nblks, 0)) > 0) {
+        nblks++;
+    }
+    if (nblks <= 1) {
+        return;
+    }
+
+    for (int i = 0; i < nblks; ) {
+        int n = 1;
+        while (i+n < nblks && blknos[i+n] == blknos[i]+n) {
+            n++;
+        }
+        blkdev_prefetch(disk, blknos[i], n);
+        i += n;
+    }
+}
+
 /**
  * Look up a single directory entry in a directory.
  *
@@ -115,7 +148,7 @@ int get_free_entry_in_block(struct fs_dirent* de) {
  * @return entry in block returned through block, or -error
  */
 int get_dir_entry_block(
-                        int inum, void *block, int* blkno, const char* name)
+                        int inum, void *block, blkno_t* blkno, const char* name)
 {
     // ensure that inode for inum is a directory
     if (!S_ISDIR(fs.inodes[inum].mode)) {
@@ -125,7 +158,9 @@ int get_dir_entry_block(
     }
     
     // get  block of directory
-    int dir_blkno, entry_no;
+    prefetch_dir_blks(inum);
+    blkno_t dir_blkno;
+    int entry_no;
     for (int blkindex = 0; ;blkindex++){
         dir_blkno = get_file_blk(inum, blkindex, block, 0);//no extend
         if (dir_blkno <= 0) {
@@ -163,9 +198,10 @@ int get_dir_entry_block(
  * @param blkno block no returned for a directory block
  * @return entry in block returned through block, or -error
  */
-int get_dir_free_entry_block(int inum, void* block, int* blkno)
+int get_dir_free_entry_block(int inum, void* block, blkno_t* blkno)
 {
-    int dir_blkno, entry_no; // extend
+    blkno_t dir_blkno; // extend
+    int entry_no;
     //search through all blocks until get one free block
     for (int blkindex = 0; ;blkindex++){
         //set block
@@ -202,7 +238,7 @@ int get_dir_entry_inode(int inum, const char* name)
     char buf[FS_BLOCK_SIZE];
 
     // get block and entry number of name in directory
-    int blkno;
+    blkno_t blkno;
     int entno = get_dir_entry_block(inum, buf, &blkno, name);
 
     // return inode of entry if found or error returned
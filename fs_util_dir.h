@@ -64,6 +64,14 @@ int get_dir_entry_in_block(struct fs_dirent* de, const char* name);
  */
 int get_free_entry_in_block(struct fs_dirent* de);
 
+/**
+ * Prefetch the blocks of a directory before scanning it, so
+ * the device reads them while earlier blocks are searched.
+ *
+ * @param inum the inode number of a directory
+ */
+void prefetch_dir_blks(int inum);
+
 /**
  * Look up a single directory entry in a directory.
  *
@@ -79,7 +87,7 @@ int get_free_entry_in_block(struct fs_dirent* de);
  * @return entry in block returned through block, or -error
  */
 int get_dir_entry_block(
-	int inum, void* block, int* blkno, const char* name);
+	int inum, void* block, blkno_t* blkno, const char* name);
 
 /**
  * Find block with free entry in directory.
@@ -95,7 +103,7 @@ int get_dir_entry_block(
  * @param blkno block no returned for a directory block
  * @return entry in block returned through block, or -error
  */
-int get_dir_free_entry_block(int inum, void* block, int* blkno);
+int get_dir_free_entry_block(int inum, void* block, blkno_t* blkno);
 
 /**
  * Look up a single directory entry in a directory.
@@ -13,13 +13,17 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <fuse.h>
 
 #include "fs_util_dir.h"
 #include "fs_util_file.h"
 #include "fs_util_meta.h"
 #include "fs_util_path.h"
+#include "fs_util_readahead.h"
 #include "fs_util_vol.h"
+#include "blkbuf.h"
 #include "blkdev.h"
 #include "min.h"
 #include "max.h"
@@ -28,21 +32,92 @@
 /** file block of 0s */
 static char zeros[FS_BLOCK_SIZE];
 
+/** data blocks reserved for extending a file */
+static struct {
+    blkno_t next;   /* next reserved block, or goal for the next run */
+    int n;          /* number of reserved blocks at next */
+    int want;       /* number of blocks still to allocate */
+} resv;
+
+/**
+ * Reserve contiguous data blocks for extending a file, so its
+ * new blocks are allocated as a few runs rather than one block
+ * at a time. Runs are allocated as the blocks are used.
+ *
+ * @param want the number of blocks to reserve
+ * @param goal the block number to start searching at, or 0
+ */
+static void reserve_data_blks(int want, blkno_t goal)
+{
+    resv.next = goal;
+    resv.n = 0;
+    resv.want = want;
+}
+
+/**
+ * Allocate a block for an inode, near the inode if the volume
+ * has block groups.
+ *
+ * @param inum the inode number
+ * @return the block number or 0 if no space
+ */
+static blkno_t alloc_blk(int inum)
+{
+    int got;
+    return get_free_blks(1, inode_goal_blk(inum), &got);
+}
+
+/**
+ * Allocate a data block for an inode, from the reserved run if
+ * any.
+ *
+ * @param inum the inode number
+ * @return the block number or 0 if no space
+ */
+static blkno_t alloc_data_blk(int inum)
+{
+    if (resv.n == 0 && resv.want > 0) {
+        // next run continues after the previous one if possible
+        resv.next = get_free_blks(resv.want, resv.next, &resv.n);
+        if (resv.n == 0) {
+            resv.want = 0;
+        }
+    }
+    if (resv.n == 0) {
+        return alloc_blk(inum);
+    }
+    resv.n--;
+    resv.want--;
+    return resv.next++;
+}
+
+/**
+ * Return reserved data blocks that were not used.
+ */
+static void release_data_blks(void)
+{
+    for (int i = 0; i < resv.n; i++) {
+        return_blk(resv.next + i);
+    }
+    resv.n = 0;
+    resv.want = 0;
+}
+
 /**
  * Returns the block number of the n-th block of the file,
- * or allocates it if it does not exist and alloc == 1. If
- * file was extended, the new block is initialized with 0s.
+ * or allocates it if it does not exist and alloc != 0. If
+ * file was extended and alloc == 1, the new block is
+ * initialized with 0s.
  *
  * @param inum the number of file inode
  * @param n the 0-based block index in file
- * @param alloc 1=allocate block if does not exist 0 = fail
- *   if does not exist
+ * @param alloc 1=allocate block if does not exist, 2=allocate
+ *   without initializing it, 0 = fail if does not exist
+ * @param buf storage for an indirect block
  * @return block number of the n-th block or 0 if unavailable
  */
-int get_file_blkno(int inum, int n, int alloc)
+static blkno_t file_blkno(int inum, int n, int alloc, uint32_t* buf)
 {
-    uint32_t buf[PTRS_PER_BLK];
-
     // get entry from direct blocks
     struct fs_inode *in = &fs.inodes[inum];
     if (n < N_DIRECT) {
@@ -50,13 +125,15 @@ int get_file_blkno(int inum, int n, int alloc)
         	if (alloc == 0) {
         		return 0;
         	}
-            int blkno = get_free_blk();
+            blkno_t blkno = alloc_data_blk(inum);
             if (blkno == 0) {  // no space
             	return 0;
             }
             in->direct[n] = blkno;
             mark_inode(inum);
-            disk->ops->write(disk, in->direct[n], 1, zeros);
+            if (alloc == 1) {
+                disk->ops->write(disk, in->direct[n], 1, zeros);
+            }
         }
         return in->direct[n];
     }
@@ -69,7 +146,7 @@ int get_file_blkno(int inum, int n, int alloc)
         		return 0;
         	}
         	// add single-indirect block
-            int blkno = get_free_blk();
+            blkno_t blkno = alloc_blk(inum);
             if (blkno == 0) {  // no space
             	return 0;
             }
@@ -78,12 +155,13 @@ int get_file_blkno(int inum, int n, int alloc)
             disk->ops->write(disk, in->indir_1, 1, zeros);
         }
         disk->ops->read(disk, in->indir_1, 1, buf);
+        blkdev_hint(disk, in->indir_1, 1, BLKDEV_HINT_META);
         if (buf[n] == 0) {
         	if (alloc == 0) {
         		return 0;
         	}
         	// extend single-indirect block
-            int blkno = get_free_blk();
+            blkno_t blkno = alloc_data_blk(inum);
             if (blkno == 0) {  // no space
             	return 0;
             }
@@ -104,7 +182,7 @@ int get_file_blkno(int inum, int n, int alloc)
     	if (alloc == 0) {
     		return 0;
     	}
-        int blkno = get_free_blk();
+        blkno_t blkno = alloc_blk(inum);
         if (blkno == 0) {  // no space
         	return 0;
         }
@@ -115,12 +193,13 @@ int get_file_blkno(int inum, int n, int alloc)
 
     // get double-indirect block
     disk->ops->read(disk, in->indir_2, 1, buf);
+    blkdev_hint(disk, in->indir_2, 1, BLKDEV_HINT_META);
     if (buf[m] == 0) {
     	if (alloc == 0) {
     		return 0;
     	}
     	// add double-indirect block with new free block
-        int blkno = get_free_blk();
+        blkno_t blkno = alloc_blk(inum);
         if (blkno == 0) {  // no space
         	return 0;
         }
@@ -130,14 +209,15 @@ int get_file_blkno(int inum, int n, int alloc)
     }
 
     // get single-indirect block from double-indirect
-    int buf_m = buf[m];
+    blkno_t buf_m = buf[m];
     disk->ops->read(disk, buf_m, 1, buf);
+    blkdev_hint(disk, buf_m, 1, BLKDEV_HINT_META);
     if (buf[k] == 0) {
     	if (alloc == 0) {
     		return 0;
     	}
     	// add single-indirect block with new free block
-        int blkno = get_free_blk();
+        blkno_t blkno = alloc_data_blk(inum);
         if (blkno == 0) {  // no space
         	return 0;
         }
@@ -148,6 +228,40 @@ int get_file_blkno(int inum, int n, int alloc)
     return buf[k];
 }
 
+/** aligned indirect block buffer for when the pool has none */
+static uint32_t spare_buf[PTRS_PER_BLK] __attribute__((aligned(BLKBUF_ALIGN)));
+
+/** protects spare_buf */
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns the block number of the n-th block of the file,
+ * or allocates it if it does not exist and alloc != 0. If
+ * file was extended and alloc == 1, the new block is
+ * initialized with 0s.
+ *
+ * @param inum the number of file inode
+ * @param n the 0-based block index in file
+ * @param alloc 1=allocate block if does not exist, 2=allocate
+ *   without initializing it, 0 = fail if does not exist
+ * @return block number of the n-th block or 0 if unavailable
+ */
+blkno_t get_file_blkno(int inum, int n, int alloc)
+{
+    // indirect blocks are read into an aligned pool buffer, or
+    // the spare one, so a lookup never fails for lack of memory
+    uint32_t *buf = blkbuf_alloc(1);
+    if (buf == NULL) {
+        pthread_mutex_lock(&spare_lock);
+        blkno_t blkno = file_blkno(inum, n, alloc, spare_buf);
+        pthread_mutex_unlock(&spare_lock);
+        return blkno;
+    }
+    blkno_t blkno = file_blkno(inum, n, alloc, buf);
+    blkbuf_free(buf, 1);
+    return blkno;
+}
+
 /**
  * Gets the n-th block of the file, or allocates it if it
  * does not exist and alloc == 1. If file was extended, new
@@ -165,8 +279,8 @@ int get_file_blkno(int inum, int n, int alloc)
  * @return block number of the n-th block, 0 if unavailable,
  *   or -error number
  */
-int get_file_blk(int inum, int n, void* block, int alloc) {
-	int blkno = get_file_blkno(inum, n, alloc);
+blkno_t get_file_blk(int inum, int n, void* block, int alloc) {
+	blkno_t blkno = get_file_blkno(inum, n, alloc);
 
 	// read block if found and block storage provided
 	if ((blkno > 0) && (block != NULL)) {
@@ -175,11 +289,504 @@ int get_file_blk(int inum, int n, void* block, int alloc) {
 			memset(block, 0, FS_BLOCK_SIZE);
 			return -EIO;
 		}
+
+		// directory blocks are metadata
+		if (S_ISDIR(fs.inodes[inum].mode)) {
+			blkdev_hint(disk, blkno, 1, BLKDEV_HINT_META);
+		}
     }
 
 	return blkno;
 }
 
+/**
+ * Read or write file blocks as one batch of block device
+ * requests. Runs of physically contiguous blocks are merged
+ * into single vectored requests, so blocks move directly
+ * between the device and their buffers, and all requests are
+ * submitted before waiting for any of them.
+ *
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param blknos the block numbers of the blocks
+ * @param bufs the FS_BLOCK_SIZE buffer for each block
+ * @param nblks the number of blocks
+ * @return SUCCESS if successful, or block device error
+ */
+static int xfer_file_blks(int op, blkno_t* blknos, char** bufs, int nblks)
+{
+    struct blkdev_req reqs[nblks];
+    struct iovec iov[nblks];
+    int nreqs = 0, niov = 0;
+    for (int i = 0; i < nblks; ) {
+        int n = 1;
+        while (i+n < nblks && blknos[i+n] == blknos[i]+n) {
+            n++;
+        }
+
+        // one buffer for each run of adjacent block buffers
+        int first_iov = niov;
+        for (int k = i; k < i+n; k++) {
+            if (niov > first_iov
+                && (char*)iov[niov-1].iov_base + iov[niov-1].iov_len == bufs[k]) {
+                iov[niov-1].iov_len += FS_BLOCK_SIZE;
+            } else {
+                iov[niov].iov_base = bufs[k];
+                iov[niov].iov_len = FS_BLOCK_SIZE;
+                niov++;
+            }
+        }
+
+        memset(&reqs[nreqs], 0, sizeof(struct blkdev_req));
+        reqs[nreqs].op = op;
+        reqs[nreqs].first_blk = blknos[i];
+        reqs[nreqs].num_blks = n;
+        reqs[nreqs].iov = &iov[first_iov];
+        reqs[nreqs].iovcnt = niov - first_iov;
+        nreqs++;
+        i += n;
+    }
+
+    int val = blkdev_submit(disk, reqs, nreqs);
+    if (val == SUCCESS) {
+        val = blkdev_complete(disk, reqs, nreqs);
+    }
+    return val;
+}
+
+/**
+ * Set up buffers for transferring bytes of a file buffer to or
+ * from a range of file blocks. Blocks entirely inside the
+ * file buffer use it directly; a first or last block only
+ * partly inside it uses head or tail instead.
+ *
+ * @param buf the file buffer
+ * @param len the number of bytes in buf
+ * @param pos offset of buf in first block
+ * @param nblks the number of blocks
+ * @param bufs the FS_BLOCK_SIZE buffer for each block
+ * @param head storage for a partial first block
+ * @param tail storage for a partial last block
+ */
+static void map_file_bufs(char* buf, size_t len, int pos, int nblks,
+                          char** bufs, char* head, char* tail)
+{
+    for (int i = 0; i < nblks; i++) {
+        bufs[i] = buf + i*FS_BLOCK_SIZE - pos;
+    }
+    if (pos != 0 || len < FS_BLOCK_SIZE) {
+        bufs[0] = head;
+    }
+    if (nblks > 1 && (pos + len) % FS_BLOCK_SIZE != 0) {
+        bufs[nblks-1] = tail;
+    }
+}
+
+/**
+ * Write bytes of content to blocks of an inode on disk,
+ * allocating the blocks that extend the file.
+ *
+ * Same results and errors as do_write().
+ *
+ * @param inum the inumber of inode to write
+ * @param buf the buffer to write
+ * @param len the number of bytes to write
+ * @param offset the offset to starting writing at
+ * @return number of bytes actually written if successful, or -error number
+ */
+static int write_file(int inum, const char* buf, size_t len, off_t offset) {
+    // get pointer to inode for inum
+    struct fs_inode *in = &fs.inodes[inum];
+
+    // index of first and last block
+    int blkidx1 = offset / FS_BLOCK_SIZE;
+    int blkidx2 = (offset + len - 1) / FS_BLOCK_SIZE;
+    int nblks = blkidx2 - blkidx1 + 1;
+
+    // blocks past the end of the file are allocated as runs
+    // that continue from its last block
+    int ncur = (in->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    int nnew = blkidx2 + 1 - max(blkidx1, ncur);
+    if (nnew > 1) {
+        blkno_t goal = (ncur > 0) ? get_file_blkno(inum, ncur-1, 0) + 1
+                                   : inode_goal_blk(inum);
+        reserve_data_blks(nnew, goal);
+    }
+
+    // get or allocate all blocks before writing any of them
+    blkno_t blknos[nblks];
+    for (int i = 0; i < nblks; i++) {
+        blknos[i] = get_file_blkno(inum, blkidx1 + i, 1);
+        if (blknos[i] == 0) {
+            // out of space: write only the blocks allocated
+            if (i == 0) {
+                release_data_blks();
+                mark_inode(inum);
+                flush_metadata();
+                return -ENOSPC;
+            }
+            nblks = i;
+            len = (blkidx1 + nblks) * FS_BLOCK_SIZE - offset;
+            break;
+        }
+    }
+    release_data_blks();
+
+    // whole blocks are written directly from buf
+    char *head = blkbuf_alloc(1), *tail = blkbuf_alloc(1);
+    if (head == NULL || tail == NULL) {
+        blkbuf_free(head, 1);
+        blkbuf_free(tail, 1);
+        return -ENOMEM;
+    }
+    char *bufs[nblks];
+    int pos = offset - blkidx1 * FS_BLOCK_SIZE;
+    map_file_bufs((char*)buf, len, pos, nblks, bufs, head, tail);
+
+    // merge partial first and last blocks with their content
+    int val = SUCCESS;
+    if (bufs[0] == head) {
+        val = xfer_file_blks(BLKDEV_READ, &blknos[0], &bufs[0], 1);
+        memcpy(head + pos, buf, min(FS_BLOCK_SIZE - pos, len));
+    }
+    if (val == SUCCESS && bufs[nblks-1] == tail) {
+        val = xfer_file_blks(BLKDEV_READ, &blknos[nblks-1], &bufs[nblks-1], 1);
+        int l = (pos + len) - (nblks-1) * FS_BLOCK_SIZE;
+        memcpy(tail, buf + len - l, l);
+    }
+
+    // write blocks as one batch
+    if (val == SUCCESS) {
+        val = xfer_file_blks(BLKDEV_WRITE, blknos, bufs, nblks);
+    }
+    blkbuf_free(head, 1);
+    blkbuf_free(tail, 1);
+
+    if (val == SUCCESS) {
+        in->size = max(in->size, offset + len);
+        in->mtime = time(NULL);  // OK thorough 2100
+    }
+    mark_inode(inum);
+    flush_metadata();
+
+    return (val == SUCCESS) ? (int)len : -EIO;
+}
+
+/** most blocks buffered by delayed allocation for all inodes */
+enum {DA_MAX_BLKS = 1024};
+
+/** blocks appended to a file but not yet allocated on disk */
+struct delalloc {
+    off_t  size;                // file size including buffered bytes
+    int    first;               // file block index of first buffered block
+    int    nblks;               // number of buffered blocks
+    int    nmeta;               // indirect blocks they will need
+    int    max;                 // capacity of blks
+    char **blks;                // buffered blocks from first on
+};
+
+/** delayed allocation state by inode number, allocated on first append */
+static struct delalloc **da_inodes;
+
+/**
+ * Get delayed allocation state of an inode with buffered blocks.
+ *
+ * @param inum the inumber of inode
+ * @return the state or NULL if no blocks are buffered
+ */
+static struct delalloc *da_find(int inum)
+{
+    return (da_inodes != NULL) ? da_inodes[inum] : NULL;
+}
+
+/**
+ * Returns the number of blocks of a file allocated on disk.
+ *
+ * @param inum the inumber of inode
+ * @return the number of blocks before the first buffered block
+ */
+static int disk_blks(int inum)
+{
+    struct delalloc *da = da_find(inum);
+    return (da != NULL) ? da->first
+                        : (int)((fs.inodes[inum].size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+}
+
+/**
+ * Returns the size of a file, including bytes buffered by
+ * delayed allocation. The inode size covers only the bytes on
+ * disk, so it never refers to blocks that are not mapped.
+ *
+ * @param inum the inumber of inode
+ * @return the file size in bytes
+ */
+off_t file_size(int inum)
+{
+    struct delalloc *da = da_find(inum);
+    return (da != NULL) ? max(da->size, fs.inodes[inum].size)
+                        : (off_t)fs.inodes[inum].size;
+}
+
+/**
+ * Returns the number of indirect blocks that allocating blocks
+ * first to end-1 of a file may add. Blocks under the
+ * double-indirect block are counted even if some exist, so the
+ * count is never too low.
+ *
+ * @param inum the inumber of inode
+ * @param first the file block index of first block
+ * @param end the file block index after the last block
+ * @return the number of indirect blocks
+ */
+static int da_meta_blks(int inum, int first, int end)
+{
+    struct fs_inode *in = &fs.inodes[inum];
+    if (end <= first) {
+        return 0;
+    }
+    int n = 0;
+    int base = N_DIRECT + PTRS_PER_BLK;
+    if (end > N_DIRECT && first < base && in->indir_1 == 0) {
+        n++;
+    }
+    if (end > base) {
+        if (in->indir_2 == 0) {
+            n++;
+        }
+        n += (end - 1 - base) / PTRS_PER_BLK - (max(first, base) - base) / PTRS_PER_BLK + 1;
+    }
+    return n;
+}
+
+/**
+ * Discard buffered blocks of an inode from file block index n
+ * on, and release its state if no blocks remain.
+ *
+ * @param inum the inumber of inode
+ * @param n the file block index of first block to discard
+ */
+static void da_drop(int inum, int n)
+{
+    struct delalloc *da = da_find(inum);
+    if (da == NULL) {
+        return;
+    }
+    int keep = max(0, n - da->first);
+    for (int i = keep; i < da->nblks; i++) {
+        blkbuf_free(da->blks[i], 1);
+    }
+    if (keep < da->nblks) {
+        fs.n_blocks_delayed -= da->nblks - keep;
+        da->nblks = keep;
+    }
+    int nmeta = da_meta_blks(inum, da->first, da->first + da->nblks);
+    fs.n_blocks_delayed -= da->nmeta - nmeta;
+    da->nmeta = nmeta;
+    if (da->nblks == 0) {
+        free(da->blks);
+        free(da);
+        da_inodes[inum] = NULL;
+    }
+}
+
+/**
+ * Copy bytes of an inode from its buffered blocks.
+ *
+ * @param da the delayed allocation state
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @param offset to start reading at, in the buffered blocks
+ */
+static void da_read(struct delalloc *da, char* buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        int i = offset / FS_BLOCK_SIZE - da->first;
+        int pos = offset % FS_BLOCK_SIZE;
+        size_t n = min(FS_BLOCK_SIZE - pos, len);
+        memcpy(buf, da->blks[i] + pos, n);
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/**
+ * Flush the buffered blocks of all inodes and write bytes to
+ * disk instead of buffering them.
+ *
+ * Same results and errors as do_write().
+ *
+ * @param inum the inumber of inode to write
+ * @param buf the buffer to write
+ * @param len the number of bytes to write
+ * @param offset the offset to starting writing at
+ * @return number of bytes actually written if successful, or -error number
+ */
+static int write_through(int inum, const char* buf, size_t len, off_t offset)
+{
+    flush_all_files();
+
+    // no space to flush the bytes before offset
+    if (offset > fs.inodes[inum].size) {
+        return -ENOSPC;
+    }
+    return write_file(inum, buf, len, offset);
+}
+
+/**
+ * Write bytes appended to an inode to its buffered blocks. If
+ * too many blocks are buffered, or the free blocks may not be
+ * enough to allocate them, the file system is flushed and the
+ * bytes are written to disk instead. The inode size is raised
+ * only when the blocks are flushed.
+ *
+ * Same results and errors as do_write().
+ *
+ * @param inum the inumber of inode to write
+ * @param buf the buffer to write
+ * @param len the number of bytes to write
+ * @param offset the offset to starting writing at, past the
+ *   blocks allocated on disk
+ * @return number of bytes actually written if successful, or -error number
+ */
+static int da_write(int inum, const char* buf, size_t len, off_t offset)
+{
+    struct fs_inode *in = &fs.inodes[inum];
+    if (da_inodes == NULL) {
+        if ((da_inodes = calloc(fs.n_inodes, sizeof(struct delalloc*))) == NULL) {
+            return write_file(inum, buf, len, offset);
+        }
+    }
+    struct delalloc *da = da_inodes[inum];
+    if (da == NULL) {
+        if ((da = calloc(1, sizeof(struct delalloc))) == NULL) {
+            return write_file(inum, buf, len, offset);
+        }
+        da->size = in->size;
+        da->first = disk_blks(inum);
+        da_inodes[inum] = da;
+    }
+
+    // new blocks must fit in memory, and on disk with the
+    // indirect blocks of every buffered file, or are written through
+    int nnew = max(0, (offset + len - 1) / FS_BLOCK_SIZE + 1 - (da->first + da->nblks));
+    int nmeta = da_meta_blks(inum, da->first, da->first + da->nblks + nnew);
+    blkno_t delayed = fs.n_blocks_delayed + nnew + nmeta - da->nmeta;
+    if (delayed > DA_MAX_BLKS || fs.n_blocks_free < delayed) {
+        return write_through(inum, buf, len, offset);
+    }
+
+    // allocate zero-filled blocks for the new blocks past the
+    // buffered ones; nothing is buffered unless all of them are
+    if (da->nblks + nnew > da->max) {
+        int cap = max(2*da->max, da->nblks + nnew);
+        char **blks = realloc(da->blks, cap * sizeof(char*));
+        if (blks == NULL) {
+            return write_through(inum, buf, len, offset);
+        }
+        da->blks = blks;
+        da->max = cap;
+    }
+    for (int i = 0; i < nnew; i++) {
+        char *blk = blkbuf_alloc(1);
+        if (blk == NULL) {
+            while (--i >= 0) {
+                blkbuf_free(da->blks[da->nblks + i], 1);
+            }
+            return write_through(inum, buf, len, offset);
+        }
+        memset(blk, 0, FS_BLOCK_SIZE);
+        da->blks[da->nblks + i] = blk;
+    }
+    da->nblks += nnew;
+    fs.n_blocks_delayed += nnew + nmeta - da->nmeta;
+    da->nmeta = nmeta;
+
+    // copy bytes to the buffered blocks
+    for (size_t done = 0; done < len; ) {
+        off_t off = offset + done;
+        int i = off / FS_BLOCK_SIZE - da->first;
+        int pos = off % FS_BLOCK_SIZE;
+        size_t n = min(FS_BLOCK_SIZE - pos, len - done);
+        memcpy(da->blks[i] + pos, buf + done, n);
+        done += n;
+    }
+
+    da->size = max(da->size, offset + len);
+    in->mtime = time(NULL);  // OK thorough 2100
+    return len;
+}
+
+/**
+ * Allocate blocks for the buffered blocks of an inode and write
+ * them to disk. The blocks are allocated as runs that continue
+ * from the last block of the file on disk.
+ *
+ * Errors:
+ *   -ENOSPC  - no space for all blocks; the file is cut short
+ *   -EIO     - error writing block
+ *
+ * @param inum the inumber of inode
+ * @return SUCCESS if successful, or -error number
+ */
+int flush_file(int inum)
+{
+    struct delalloc *da = da_find(inum);
+    if (da == NULL) {
+        return SUCCESS;
+    }
+    struct fs_inode *in = &fs.inodes[inum];
+
+    // no block is written before the whole file is mapped
+    blkno_t goal = (da->first > 0) ? get_file_blkno(inum, da->first - 1, 0) + 1
+                                    : inode_goal_blk(inum);
+    reserve_data_blks(da->nblks, goal);
+    blkno_t blknos[da->nblks];
+    int n;
+    for (n = 0; n < da->nblks; n++) {
+        if ((blknos[n] = get_file_blkno(inum, da->first + n, 2)) == 0) {
+            break;
+        }
+    }
+    release_data_blks();
+
+    // the inode size covers the buffered bytes once their
+    // blocks are mapped and written
+    int val = SUCCESS;
+    off_t size = da->size;
+    if (n < da->nblks) {
+        // out of space: bytes past the allocated blocks are lost
+        size = min(size, (da->first + n) * FS_BLOCK_SIZE);
+        val = -ENOSPC;
+    }
+    if (n > 0 && xfer_file_blks(BLKDEV_WRITE, blknos, da->blks, n) != SUCCESS) {
+        val = -EIO;
+    } else {
+        in->size = max(in->size, size);
+    }
+    da_drop(inum, da->first);
+
+    mark_inode(inum);
+    flush_metadata();
+    return val;
+}
+
+/**
+ * Allocate and write the buffered blocks of all inodes.
+ *
+ * @return SUCCESS if successful, or the first -error number
+ */
+int flush_all_files(void)
+{
+    int val = SUCCESS;
+    for (int inum = 0; da_inodes != NULL && inum < fs.n_inodes; inum++) {
+        int v = flush_file(inum);
+        if (val == SUCCESS) {
+            val = v;
+        }
+    }
+    return val;
+}
+
 /**
  * Read bytes from content of an inode.
  *
@@ -190,6 +797,7 @@ int get_file_blk(int inum, int n, void* block, int alloc) {
  *
  * Errors:
  *   -EIO     - error reading block
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param buf the read buffer
@@ -198,51 +806,82 @@ int get_file_blk(int inum, int n, void* block, int alloc) {
  * @return number of bytes actually read if successful, or -error number
  */
 int do_read(int inum, char* buf, size_t len, off_t offset) {
-    // get pointer to inode for inum
-    struct fs_inode *in = &fs.inodes[inum];
-
     // done if offset greater than file size
-    if (offset >= in->size) {
+    off_t size = file_size(inum);
+    if (offset >= size || len == 0) {
         return 0;
     }
 
     // adjust length to length of file from offset
-    if (in->size < offset + len) {
-        len = in->size - offset;
+    if (size < offset + (off_t)len) {
+        len = size - offset;
     }
 
-    // index of first block
+    // bytes past the blocks on disk are copied from the buffer
+    struct delalloc *da = da_find(inum);
+    if (da != NULL && offset + (off_t)len > (off_t)da->first * FS_BLOCK_SIZE) {
+        off_t end = (off_t)da->first * FS_BLOCK_SIZE;
+        size_t ndisk = (offset < end) ? end - offset : 0;
+        da_read(da, buf + ndisk, len - ndisk, offset + ndisk);
+        if (ndisk > 0) {
+            int val = do_read(inum, buf, ndisk, offset);
+            if (val < 0) {
+                return val;
+            }
+        }
+        return len;
+    }
+
+    // index of first and last block
     int blkidx1 = offset / FS_BLOCK_SIZE;
-    int blkidx2 = (offset + len) / FS_BLOCK_SIZE;
+    int blkidx2 = (offset + len - 1) / FS_BLOCK_SIZE;
+    int nblks = blkidx2 - blkidx1 + 1;
 
-    // read blocks into buf
-    offset -= blkidx1 * FS_BLOCK_SIZE;
-    int _len = len;
-    for (int blkindex = blkidx1; blkindex <= blkidx2; blkindex++) {
-    	// get block for block index
-        char blk[FS_BLOCK_SIZE];
-        int blkno = get_file_blk(inum, blkindex, blk, 0);
+    // look up all blocks before reading any of them
+    blkno_t blknos[nblks];
+    for (int i = 0; i < nblks; i++) {
+        blknos[i] = get_file_blkno(inum, blkidx1 + i, 0);
 
         // report error if not found
-        if (blkno <= 0) {
+        if (blknos[i] <= 0) {
             return -EIO;
         }
+    }
 
-        // copy block content to buf
-        int l = min(FS_BLOCK_SIZE - offset, len);
-        memcpy(buf, &blk[offset], l);
-
-        buf += l;
-        len -= l;
-        offset = 0;
+    // read whole blocks directly into buf as one batch
+    char *head = blkbuf_alloc(1), *tail = blkbuf_alloc(1);
+    if (head == NULL || tail == NULL) {
+        blkbuf_free(head, 1);
+        blkbuf_free(tail, 1);
+        return -ENOMEM;
+    }
+    char *bufs[nblks];
+    int pos = offset - blkidx1 * FS_BLOCK_SIZE;
+    map_file_bufs(buf, len, pos, nblks, bufs, head, tail);
+    if (xfer_file_blks(BLKDEV_READ, blknos, bufs, nblks) < 0) {
+        blkbuf_free(head, 1);
+        blkbuf_free(tail, 1);
+        return -EIO;
     }
 
-    return _len;
+    // copy partial first and last blocks to buf
+    if (bufs[0] == head) {
+        memcpy(buf, head + pos, min(FS_BLOCK_SIZE - pos, len));
+    }
+    if (bufs[nblks-1] == tail) {
+        int l = (pos + len) - (nblks-1) * FS_BLOCK_SIZE;
+        memcpy(buf + len - l, tail, l);
+    }
+    blkbuf_free(head, 1);
+    blkbuf_free(tail, 1);
 
+    return len;
 }
 
 /**
- *  write bytes of content to an inode.
+ *  write bytes of content to an inode. Bytes appended to a
+ *  regular file are buffered, and their blocks are allocated
+ *  when the file is flushed.
  *
  * It should return exactly the number of bytes requested, except on
  * error.
@@ -252,6 +891,8 @@ int do_read(int inum, char* buf, size_t len, off_t offset) {
  *   -EINVAL  - if 'offset' is greater than current file length.
  *  			(POSIX semantics support the creation of files with
  *  			"holes" in them, but we don't)
+ *   -EIO     - error reading or writing block
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param buf the buffer to write
@@ -265,53 +906,81 @@ int do_write(int inum, const char* buf, size_t len, off_t offset) {
     struct fs_inode *in = &fs.inodes[inum];
 
     // return error code of offset out of range
-    if (offset > in->size) {
+    if (offset > file_size(inum)) {
         return -EINVAL;
     }
+    if (len == 0) {
+        return 0;
+    }
 
-    int blkidx1 = offset / FS_BLOCK_SIZE;
-    int blkidx2 = (offset + len) / FS_BLOCK_SIZE;
-
-    // write buffer to file blocks
-    offset -= blkidx1 * FS_BLOCK_SIZE;
-    int _len = len;
-    for (int blkindex = blkidx1; blkindex <= blkidx2; blkindex++) {
-    	// get block
-        char blk[FS_BLOCK_SIZE];
-    	int blkno = get_file_blk(inum, blkindex, blk, 1);
-
-    	// return error code if error or out of space
-    	if (blkno <= 0) {
-            mark_inode(inum);
-            flush_metadata();
-            return (blkno == 0) ? -ENOSPC : blkno;
+    // prefetched blocks of the file become stale
+    invalidate_read_ahead(inum);
+
+    // bytes past the blocks on disk of a regular file are
+    // buffered until the file is flushed
+    if (S_ISREG(in->mode)) {
+        off_t end = (off_t)disk_blks(inum) * FS_BLOCK_SIZE;
+        if (offset + (off_t)len > end) {
+            size_t ndisk = (offset < end) ? end - offset : 0;
+            if (ndisk > 0) {
+                int val = write_file(inum, buf, ndisk, offset);
+                if (val < (int)ndisk) {
+                    return val;
+                }
+            }
+            int val = da_write(inum, buf + ndisk, len - ndisk, offset + ndisk);
+            return (val < 0 && ndisk == 0) ? val : (int)ndisk + max(val, 0);
         }
+    }
 
-        // copy more buffer data to block
-        int l = min(FS_BLOCK_SIZE - offset, len);
-        memcpy(&blk[offset], buf, l);
+    return write_file(inum, buf, len, offset);
+}
 
-        // write block back to disk
-        disk->ops->write(disk, blkno, 1, blk);
-        buf += l;
-        len -= l;
-        offset = 0;
-        in->size += l;
-        in->mtime = time(NULL);  // OK thorough 2100
+/**
+ * Free the data blocks of an indirect block from entry keep on.
+ *
+ * @param blkno the indirect block number
+ * @param keep the number of leading entries to keep
+ * @return 1 if no entries remain and the indirect block
+ *   itself can be freed, 0 otherwise
+ */
+static int truncate_indir(blkno_t blkno, int keep)
+{
+    if (keep >= PTRS_PER_BLK) {
+        return 0;
+    }
+    if (keep < 0) {
+        keep = 0;
     }
 
-    mark_inode(inum);
-    flush_metadata();
-
-    return _len - len;
+    uint32_t buf[PTRS_PER_BLK];
+    disk->ops->read(disk, blkno, 1, buf);
+    int changed = 0;
+    for (int i = keep; i < PTRS_PER_BLK; i++) {
+        if (buf[i] != 0) {  // block allocated
+            return_blk(buf[i]);
+            buf[i] = 0;
+            changed = 1;
+        }
+    }
+    if (keep == 0) {
+        return 1;
+    }
+    if (changed) {
+        disk->ops->write(disk, blkno, 1, buf);
+    }
+    return 0;
 }
 
 /**
- * Truncate data specified by inode to given length
+ * Truncate data specified by inode to given length. Blocks are
+ * freed by their index in the file, so the result does not
+ * depend on the order in which the blocks were allocated.
  *
  *
  * Errors
  *   -EINVAL  - invalid argument
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param len new length of file
@@ -319,99 +988,101 @@ int do_write(int inum, const char* buf, size_t len, off_t offset) {
  */
 int do_truncate(int inum, int len)
 {
-    int file_size = fs.inodes[inum].size;
-    if (len < 0 || len > file_size) {
+    if (len < 0 || len > file_size(inum)) {
     	return -EINVAL;		/* invalid argument */
     }
 
     /// get inode for inum
     struct fs_inode *in = &fs.inodes[inum];
 
-	uint32_t buf[PTRS_PER_BLK], buf1[PTRS_PER_BLK];
-    int i, j;
-    // get the max block to read
-    int blkindex1 = (int)(len / FS_BLOCK_SIZE);
-    // if the length is the multiple of FS_BLOCK_SIZE, then only sub one from the index as we only need index-1 blocks
-    if (len > 0 && len % FS_BLOCK_SIZE == 0) {
-        blkindex1--;
-    }
-    int blknum = (int)(file_size / FS_BLOCK_SIZE) + 1;
-    if (file_size > 0 && file_size % FS_BLOCK_SIZE == 0) {
-        blknum--;
-    }
-    // get block for block index
-    char blk[FS_BLOCK_SIZE];
-    int blkno0 = get_file_blkno(inum, 0, 0);
-    int blkno1 = get_file_blkno(inum, blkindex1, 0);
-    int minblkno = min(blkno0, blkno1);
-    int maxblkno = max(blkno0, blkno1);
-    if (len == 0) {
-        maxblkno -= 1;
+    // a partial last block is zeroed through an aligned buffer
+    char *blk = NULL;
+    if (len % FS_BLOCK_SIZE != 0 && (blk = blkbuf_alloc(1)) == NULL) {
+        return -ENOMEM;
     }
 
+    // prefetched blocks may be freed and reused
+    invalidate_read_ahead(inum);
 
-    int offset = blkindex1 * FS_BLOCK_SIZE;
-    int _len = len-offset;
-    char blk1[FS_BLOCK_SIZE];
+    // number of blocks that hold the first len bytes
+    int nkeep = (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
 
-    do_write(inum, blk1, _len, offset);
+    // discard buffered blocks past the end and zero the rest
+    // of the last one; blocks on disk are then all kept
+    struct delalloc *da = da_find(inum);
+    if (da != NULL && nkeep > da->first) {
+        da_drop(inum, nkeep);
+        int off = len % FS_BLOCK_SIZE;
+        if (off != 0) {
+            memset(da->blks[nkeep-1 - da->first] + off, 0, FS_BLOCK_SIZE - off);
+        }
+        da->size = len;
+    } else {
+        da_drop(inum, 0);
+    }
 
-    // free the blocks beyond
+    // zero the rest of the last block, so extending reads 0s
+    if (blk != NULL) {
+        blkno_t blkno = get_file_blk(inum, nkeep-1, blk, 0);
+        if (blkno > 0) {
+            int off = len % FS_BLOCK_SIZE;
+            memset(blk + off, 0, FS_BLOCK_SIZE - off);
+            disk->ops->write(disk, blkno, 1, blk);
+        }
+        blkbuf_free(blk, 1);
+    }
 
-    /* unlink double indirect nodes */
+    /* free double indirect nodes */
     if (in->indir_2) {
+        uint32_t buf[PTRS_PER_BLK];
         disk->ops->read(disk, in->indir_2, 1, buf);
-        for (i = 0; i < PTRS_PER_BLK; i++) {
+        int keep = nkeep - N_DIRECT - PTRS_PER_BLK;
+        int changed = 0, remain = 0;
+        for (int i = 0; i < PTRS_PER_BLK; i++) {
             if (buf[i] != 0) {  // block allocated
-                disk->ops->read(disk, buf[i], 1, buf1);
-                for (j = 0; j < PTRS_PER_BLK; j++) {
-                    if (buf1[j] > maxblkno) { // block allocated
-                        return_blk(buf1[j]);  // free block
-                        blknum--;
-                    } else {
-                        break;
-                    }
-                }
-                if (blknum >= blkindex1 + 1) {
-                    return_blk(buf[i]);  // return head block
+                if (truncate_indir(buf[i], keep - i*PTRS_PER_BLK)) {
+                    return_blk(buf[i]);
+                    buf[i] = 0;
+                    changed = 1;
+                } else {
+                    remain = 1;
                 }
             }
         }
-        if (blknum >= blkindex1 + 1) {
+        if (!remain) {
             return_blk(in->indir_2); // free head block
             in->indir_2 = 0;
+        } else if (changed) {
+            disk->ops->write(disk, in->indir_2, 1, buf);
         }
     }
 
-    /* unlink single indirect nodes */
+    /* free single indirect nodes */
     if (in->indir_1) {
-        disk->ops->read(disk, in->indir_1, 1, buf);
-        for (i = 0; i < PTRS_PER_BLK; i++) {
-            if (buf[i] > maxblkno) {
-                return_blk(buf[i]);  // free head block
-                blknum--;
-            } else {
-                break;
-            }
-        }
-        if (blknum >= blkindex1 + 1) {
+        if (truncate_indir(in->indir_1, nkeep - N_DIRECT)) {
             return_blk(in->indir_1);
             in->indir_1 = 0;
         }
     }
 
-    /* unlink direct nodes */
-    for (i = 0; i < N_DIRECT; i++) {
-        if (in->direct[i] > maxblkno) {
+    /* free direct nodes */
+    for (int i = nkeep; i < N_DIRECT; i++) {
+        if (in->direct[i] != 0) {
             return_blk(in->direct[i]);  // free direct blocks
             in->direct[i] = 0;
         }
     }
 
-    // reset inode size and modification time
-    in->size = len;
+    // reset inode size and modification time; bytes still
+    // buffered are counted by the inode size when flushed
+    if (da_find(inum) == NULL) {
+        in->size = len;
+    }
     in->mtime = time(NULL);  // OK thorough 2100
 
+    // release storage of freed blocks in one batch
+    discard_freed_blks();
+
     return 0;
 }
 
@@ -431,9 +1102,9 @@ void do_stat(int inum, struct stat *sb)
     sb->st_nlink = in->nlink;
     sb->st_uid = in->uid;
     sb->st_gid = in->gid;
-    sb->st_size = in->size;
+    sb->st_size = file_size(inum);
     // number of 512-byte blocks rounded up to nearest block
-    sb->st_blocks =  (in->size + 512 - 1) / 512;
+    sb->st_blocks =  (sb->st_size + 512 - 1) / 512;
     sb->st_atime = sb->st_mtime = in->mtime;
     sb->st_ctime = in->ctime;
 }
@@ -444,13 +1115,15 @@ void do_stat(int inum, struct stat *sb)
  *  * Errors
  *   -ENOSPC   - free inode not available
  *
+ * @param dir_inum the inode number of the parent directory
  * @param mode the mode, indicating block or character-special file
  * @param ftype the type of file (S_IFDIR for dir, S_IFREG for regular)
  * @return inum of entry if successful, -error if error
  */
-int init_new_inode(mode_t mode, unsigned ftype) {
-    // allocate and fill inode for new entry
-    int inum = get_free_inode();
+int init_new_inode(int dir_inum, mode_t mode, unsigned ftype) {
+    // allocate and fill inode for new entry: directories may be
+    // spread over the volume, files stay near their directory
+    int inum = get_free_inode(dir_inum, (ftype & S_IFMT) == S_IFDIR);
     if (inum == 0) {
         return -ENOSPC;	// no free inode
     }
@@ -495,7 +1168,7 @@ int do_mkentry(int dir_inum, const char* leaf, mode_t mode, unsigned ftype)
     }
 
     // make sure entry does not exist in directory
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
 	if (get_dir_entry_block(dir_inum, buf, &blkno, leaf) >= 0) {
 		return -EEXIST;	// leaf already exists
@@ -508,7 +1181,7 @@ int do_mkentry(int dir_inum, const char* leaf, mode_t mode, unsigned ftype)
     }
 
 	// init new inode for entry
-	int inum = init_new_inode(mode, ftype);
+	int inum = init_new_inode(dir_inum, mode, ftype);
 	if (inum < 0) {
 		return inum;
 	}
@@ -551,7 +1224,7 @@ int do_mklink(int inum, int dir_inum, const char* leaf) {
     }
 
     // make sure entry does not exist in directory
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
     if (get_dir_entry_block(dir_inum, buf, &blkno, leaf) >= 0) {
         return -EEXIST;	// leaf already exists
@@ -595,7 +1268,7 @@ int do_unlink(int inum, int dir_inum, const char* leaf) {
     }
 
     /* find directory entry block and index */
-    int blkno;
+    blkno_t blkno;
     char buf[FS_BLOCK_SIZE];
     int entno = get_dir_entry_block(dir_inum, buf, &blkno, leaf);
     if (entno < 0) {
@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 
+#include "blkdev.h"
+
 /**
  *
  * @param inum
@@ -38,16 +40,17 @@ int decrement_link_count(int inum);
 
 /**
  * Returns the block number of the n-th block of the file,
- * or allocates it if it does not exist and alloc == 1. If
- * file was extended, the new block is initialized with 0s.
+ * or allocates it if it does not exist and alloc != 0. If
+ * file was extended and alloc == 1, the new block is
+ * initialized with 0s.
  *
  * @param inum the number of file inode
  * @param n the 0-based block index in file
- * @param alloc 1=allocate block if does not exist 0 = fail
- *   if does not exist
+ * @param alloc 1=allocate block if does not exist, 2=allocate
+ *   without initializing it, 0 = fail if does not exist
  * @return block number of the n-th block or 0 if unavailable
  */
-int get_file_blkno(int inum, int n, int alloc);
+blkno_t get_file_blkno(int inum, int n, int alloc);
 
 /**
  * Gets the n-th block of the file, or allocates it if it
@@ -66,7 +69,17 @@ int get_file_blkno(int inum, int n, int alloc);
  * @return block number of the n-th block, 0 if unavailable,
  *   or -error number
  */
-int get_file_blk(int inum, int n, void* block, int alloc);
+blkno_t get_file_blk(int inum, int n, void* block, int alloc);
+
+/**
+ * Returns the size of a file, including bytes buffered by
+ * delayed allocation. The inode size covers only the bytes on
+ * disk, so it never refers to blocks that are not mapped.
+ *
+ * @param inum the inumber of inode
+ * @return the file size in bytes
+ */
+off_t file_size(int inum);
 
 /**
  * Read bytes from content of an inode.
@@ -78,6 +91,7 @@ int get_file_blk(int inum, int n, void* block, int alloc);
  *
  * Errors:
  *   -EIO     - error reading block
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param buf the read buffer
@@ -88,7 +102,9 @@ int get_file_blk(int inum, int n, void* block, int alloc);
 int do_read(int inum, char* buf, size_t len, off_t offset);
 
 /**
- *  write bytes of content to an inode.
+ *  write bytes of content to an inode. Bytes appended to a
+ *  regular file are buffered, and their blocks are allocated
+ *  when the file is flushed.
  *
  * It should return exactly the number of bytes requested, except on
  * error.
@@ -98,6 +114,8 @@ int do_read(int inum, char* buf, size_t len, off_t offset);
  *   -EINVAL  - if 'offset' is greater than current file length.
  *  			(POSIX semantics support the creation of files with
  *  			"holes" in them, but we don't)
+ *   -EIO     - error reading or writing block
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param buf the buffer to write
@@ -108,12 +126,34 @@ int do_read(int inum, char* buf, size_t len, off_t offset);
  */
 int do_write(int inum, const char* buf, size_t len, off_t offset);
 
+/**
+ * Allocate blocks for the buffered blocks of an inode and write
+ * them to disk. The blocks are allocated as runs that continue
+ * from the last block of the file on disk.
+ *
+ * Errors:
+ *   -ENOSPC  - no space for all blocks; the file is cut short
+ *   -EIO     - error writing block
+ *
+ * @param inum the inumber of inode
+ * @return SUCCESS if successful, or -error number
+ */
+int flush_file(int inum);
+
+/**
+ * Allocate and write the buffered blocks of all inodes.
+ *
+ * @return SUCCESS if successful, or the first -error number
+ */
+int flush_all_files(void);
+
 /**
  * Truncate data specified by inode.
  * Currently only length 0 is supported.
  *
  * Errors
  *   -EINVAL  - invalid argument
+ *   -ENOMEM  - cannot allocate block buffer
  *
  * @param inum the inumber of inode to truncate
  * @param len new length of file -- currently only 0 allowed
@@ -135,11 +175,12 @@ void do_stat(int inum, struct stat *sb);
  *  * Errors
  *   -ENOSPC   - free inode not available
  *
+ * @param dir_inum the inode number of the parent directory
  * @param mode the mode, indicating block or character-special file
  * @param ftype the type of file (S_IFDIR for dir, S_IFREG for regular)
  * @return inum of entry if successful, -error if error
  */
-int init_new_inode(mode_t mode, unsigned ftype);
+int init_new_inode(int dir_inum, mode_t mode, unsigned ftype);
 
 /**
  * Make a file system file or directory entry for the file type.
@@ -9,58 +9,339 @@
  */
 
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "fs_util_meta.h"
 #include "fs_util_vol.h"
 #include "blkdev.h"
 
+/** freed blocks not yet discarded */
+static blkno_t *freed_blks;
+
+/** number of freed blocks and capacity of freed_blks */
+static int n_freed, max_freed;
+
+/**
+ * Compare block numbers for qsort.
+ */
+static int cmp_blkno(const void *a, const void *b)
+{
+    blkno_t x = *(const blkno_t*)a, y = *(const blkno_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Discard blocks freed since the last call, so the device can
+ * release their storage. Adjacent blocks are discarded with a
+ * single ranged request.
+ */
+void discard_freed_blks(void)
+{
+    qsort(freed_blks, n_freed, sizeof(blkno_t), cmp_blkno);
+    for (int i = 0; i < n_freed; ) {
+        int n = 1;
+        while (i+n < n_freed && freed_blks[i+n] == freed_blks[i]+n) {
+            n++;
+        }
+        blkdev_discard(disk, freed_blks[i], n);
+        i += n;
+    }
+    n_freed = 0;
+}
+
 /**
- * Flush dirty metadata blocks to disk.
+ * Returns the device block number of a metadata block. Without
+ * block groups, metadata blocks are at the start of the device.
+ * With block groups, map and inode blocks are in their groups.
+ *
+ * @param i the metadata block number
+ * @return the device block number
+ */
+blkno_t meta_blkno(blkno_t i)
+{
+    if (fs.n_groups == 0 || i < fs.inode_map_base) {
+        return i;  // superblock and group descriptors
+    }
+    if (i < fs.block_map_base) {
+        return fs.groups[i - fs.inode_map_base].inode_map;
+    }
+    if (i < fs.inode_base) {
+        return fs.groups[i - fs.block_map_base].block_map;
+    }
+    blkno_t n = i - fs.inode_base;
+    blkno_t per_group = fs.inodes_per_group / INODES_PER_BLK;
+    return fs.groups[n / per_group].inode_table + n % per_group;
+}
+
+/**
+ * Flush dirty metadata blocks to disk, then discard blocks
+ * freed by the metadata updates.
  */
 void flush_metadata(void)
 {
-    for (int i = 0; i < fs.n_meta; i++) {
+    for (blkno_t i = 0; i < fs.n_meta; i++) {
         if (fs.dirty[i] != NULL) {
-            disk->ops->write(disk, i, 1, fs.dirty[i]);
+            blkno_t blkno = meta_blkno(i);
+            disk->ops->write(disk, blkno, 1, fs.dirty[i]);
+            blkdev_hint(disk, blkno, 1, BLKDEV_HINT_META);
             fs.dirty[i] = NULL;
         }
     }
+    discard_freed_blks();
 }
 
 /**
- * Gets a free block number from the free list.
+ * Mark the descriptor block of a block group dirty.
  *
- * @return free block number or 0 if none available
+ * @param g the group number
  */
-int get_free_blk(void)
+static void mark_group(int g)
 {
-    for (int i = 0; i < fs.n_blocks; i++) {
-        if (!FD_ISSET(i, fs.block_map)) {
-        	// mark block allocated
-            FD_SET(i, fs.block_map);
+    int n = g / GROUP_DESCS_PER_BLK;
+    fs.dirty[1 + n] = (void*)fs.groups + n*FS_BLOCK_SIZE;
+}
 
-            // mark block map block dirty
-            int n = i / BITS_PER_BLK;
-            fs.dirty[fs.block_map_base + n] = (void*)fs.block_map + n*FS_BLOCK_SIZE;
-            return i;
+/**
+ * Adjust the free block count of the group of a block.
+ *
+ * @param blkno the block number
+ * @param delta the change in free blocks
+ */
+static void count_group_blk(blkno_t blkno, int delta)
+{
+    if (fs.n_groups > 0) {
+        int g = blkno / fs.blocks_per_group;
+        fs.groups[g].free_blocks += delta;
+        mark_group(g);
+    }
+}
+
+/**
+ * Adjust the free inode and directory counts of the group of
+ * an inode.
+ *
+ * @param inum the inode number
+ * @param delta the change in free inodes
+ * @param is_dir 1 if the inode is a directory
+ */
+static void count_group_inode(int inum, int delta, int is_dir)
+{
+    if (fs.n_groups > 0) {
+        int g = inum / fs.inodes_per_group;
+        fs.groups[g].free_inodes += delta;
+        if (is_dir) {
+            fs.groups[g].n_dirs -= delta;
         }
+        mark_group(g);
     }
-    return 0;
 }
 
 /**
- * Return a block to the free list.
+ * Choose the block group for a new inode, Orlov style. A
+ * directory made in the root directory goes to a group with at
+ * least the average free inodes and blocks and the fewest
+ * directories, so top-level trees spread over the volume. Other
+ * directories stay in or after the group of their parent unless
+ * it is crowded with directories or short of space, and files
+ * stay in the group of their directory when it has room.
+ *
+ * @param dir_inum the inode number of the parent directory
+ * @param is_dir 1 if the new inode is a directory
+ * @return the group number, or -1 if no group has a free inode
+ */
+static int find_inode_group(int dir_inum, int is_dir)
+{
+    int ngroups = fs.n_groups;
+    int parent = dir_inum / fs.inodes_per_group;
+    int64_t avg_inodes = fs.n_inodes_free / ngroups;
+    int64_t avg_blocks = fs.n_blocks_free / ngroups;
+
+    if (is_dir && dir_inum == fs.root_inode) {
+        // rotate the start, so groups that tie take turns
+        static int next_group;
+        int best = -1;
+        for (int i = 0; i < ngroups; i++) {
+            int g = (next_group + i) % ngroups;
+            struct fs_group_desc *gd = &fs.groups[g];
+            if (gd->free_inodes > 0 && gd->free_inodes >= avg_inodes
+                && gd->free_blocks >= avg_blocks
+                && (best < 0 || gd->n_dirs < fs.groups[best].n_dirs)) {
+                best = g;
+            }
+        }
+        if (best >= 0) {
+            next_group = (best + 1) % ngroups;
+            return best;
+        }
+    } else if (is_dir) {
+        int64_t ndirs = 0;
+        for (int g = 0; g < ngroups; g++) {
+            ndirs += fs.groups[g].n_dirs;
+        }
+        int64_t max_dirs = ndirs / ngroups + fs.inodes_per_group / 16;
+        for (int i = 0; i < ngroups; i++) {
+            struct fs_group_desc *gd = &fs.groups[(parent + i) % ngroups];
+            if (gd->n_dirs < max_dirs && gd->free_inodes > 0
+                && gd->free_inodes >= avg_inodes / 4
+                && gd->free_blocks >= avg_blocks / 4) {
+                return (parent + i) % ngroups;
+            }
+        }
+    } else {
+        for (int i = 0; i < ngroups; i++) {
+            struct fs_group_desc *gd = &fs.groups[(parent + i) % ngroups];
+            if (gd->free_inodes > 0 && gd->free_blocks > 0) {
+                return (parent + i) % ngroups;
+            }
+        }
+    }
+
+    // otherwise any group from the parent's with a free inode
+    for (int i = 0; i < ngroups; i++) {
+        if (fs.groups[(parent + i) % ngroups].free_inodes > 0) {
+            return (parent + i) % ngroups;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the inode map bit of an inode. With block groups,
+ * each group has its own inode map block.
+ *
+ * @param inum the inode number
+ * @return the bit number
+ */
+static int64_t inode_bit(int inum)
+{
+    if (fs.n_groups == 0) {
+        return inum;
+    }
+    return (int64_t)(inum / fs.inodes_per_group) * BITS_PER_BLK
+           + inum % fs.inodes_per_group;
+}
+
+/**
+ * Returns the inode of an inode map bit.
+ *
+ * @param bit the bit number
+ * @return the inode number
+ */
+static int bit_inode(int64_t bit)
+{
+    if (fs.n_groups == 0) {
+        return (int)bit;
+    }
+    return (int)(bit / BITS_PER_BLK) * fs.inodes_per_group
+           + (int)(bit % BITS_PER_BLK);
+}
+
+/**
+ * Returns the block number to start searching at for blocks of
+ * an inode: the first block of the inode's block group, so data
+ * is kept near its inode. Without block groups, returns 0 to
+ * continue after the last block allocated.
+ *
+ * @param inum the inode number
+ * @return the block number to search from, or 0
+ */
+blkno_t inode_goal_blk(int inum)
+{
+    if (fs.n_groups == 0) {
+        return 0;
+    }
+    return (blkno_t)(inum / fs.inodes_per_group) * fs.blocks_per_group;
+}
+
+/**
+ * Gets a run of contiguous free blocks from the free list. The
+ * run starts at the first free block at or after goal, and
+ * holds up to want blocks.
+ *
+ * @param want the number of blocks wanted
+ * @param goal the block number to start searching at, or 0
+ *   to continue after the last block allocated
+ * @param got the number of blocks allocated returned
+ * @return first free block number or 0 if none available
+ */
+blkno_t get_free_blks(int want, blkno_t goal, int *got)
+{
+    *got = 0;
+
+    // a freed block must be discarded before it is reused
+    if (n_freed > 0) {
+        discard_freed_blks();
+    }
+
+    // next fit: by default continue where the last search ended
+    if (goal <= 0) {
+        goal = fs.block_cursor;
+    }
+    blkno_t first = bit_find_clear(fs.block_map, fs.n_blocks, goal);
+    if (first < 0) {
+        return 0;
+    }
+    int n = (int)bit_clear_run(fs.block_map, fs.n_blocks, first, want);
+    fs.block_cursor = first + n;
+
+	// mark blocks allocated
+    for (blkno_t i = first; i < first + n; i++) {
+        bit_set(fs.block_map, i);
+        count_group_blk(i, -1);
+    }
+    fs.n_blocks_free -= n;
+
+    // mark block map blocks dirty
+    for (blkno_t m = first / BITS_PER_BLK; m <= (first + n - 1) / BITS_PER_BLK; m++) {
+        fs.dirty[fs.block_map_base + m] = (void*)fs.block_map + m*FS_BLOCK_SIZE;
+    }
+
+    *got = n;
+    return first;
+}
+
+/**
+ * Gets a free block number from the free list. The search
+ * starts after the last block allocated, so allocation does
+ * not rescan the full start of a nearly full volume.
+ *
+ * @return free block number or 0 if none available
+ */
+blkno_t get_free_blk(void)
+{
+    int got;
+    return get_free_blks(1, 0, &got);
+}
+
+/**
+ * Return a block to the free list. The block is discarded
+ * with other freed blocks by discard_freed_blks().
  *
  * @param  blkno the block number
  */
-void return_blk(int blkno)
+void return_blk(blkno_t blkno)
 {
 	// mark block free
-    FD_CLR(blkno, fs.block_map);
+    bit_clear(fs.block_map, blkno);
+    fs.n_blocks_free++;
+    count_group_blk(blkno, 1);
 
     // mark block map block dirty
-    int n = blkno / BITS_PER_BLK;
+    blkno_t n = blkno / BITS_PER_BLK;
     fs.dirty[fs.block_map_base + n] = (void*)fs.block_map + n*FS_BLOCK_SIZE;
+
+    // add block to batch to discard
+    if (n_freed == max_freed) {
+        int max = (max_freed == 0) ? 64 : 2*max_freed;
+        blkno_t *blks = realloc(freed_blks, max * sizeof(blkno_t));
+        if (blks == NULL) {
+            blkdev_discard(disk, blkno, 1);  // cannot batch
+            return;
+        }
+        freed_blks = blks;
+        max_freed = max;
+    }
+    freed_blks[n_freed++] = blkno;
 }
 
 /**
@@ -69,8 +350,8 @@ void return_blk(int blkno)
  * @param blkno the block number
  * @param 1 (true) or 0 (false)
  */
-int is_free_blk(int blkno) {
-	return (FD_ISSET(blkno, fs.block_map) == 0);
+int is_free_blk(blkno_t blkno) {
+	return (bit_test(fs.block_map, blkno) == 0);
 
 }
 
@@ -81,28 +362,46 @@ int is_free_blk(int blkno) {
  * @param 1 (true) or 0 (false)
  */
 int is_free_inode(int inum) {
-	return (FD_ISSET(inum, fs.inode_map) == 0);
+	return (bit_test(fs.inode_map, inode_bit(inum)) == 0);
 }
 
 /**
- * Gets a free inode number from the free list.
+ * Gets a free inode number from the free list. With block
+ * groups, the inode is placed by find_inode_group(), so
+ * top-level directories spread over the volume and files stay
+ * near their directory. Otherwise the search starts after the
+ * last inode allocated.
  *
+ * @param dir_inum the inode number of the parent directory
+ * @param is_dir 1 if the new inode is a directory
  * @return a free inode number or 0 if none available
  */
-int get_free_inode(void)
+int get_free_inode(int dir_inum, int is_dir)
 {
-    for (int i = 0; i < fs.n_inodes; i++) {
-        if (!FD_ISSET(i, fs.inode_map)) {
-        	// mark inode allocated
-            FD_SET(i, fs.inode_map);
-
-            // mark inode map block dirty
-            int n = i / BITS_PER_BLK;
-            fs.dirty[fs.inode_map_base + n] = (void*)fs.inode_map + n*FS_BLOCK_SIZE;
-            return i;
+    int64_t start = fs.inode_cursor;
+    if (fs.n_groups > 0) {
+        int g = find_inode_group(dir_inum, is_dir);
+        if (g < 0) {
+            return 0;
         }
+        start = inode_bit(g * fs.inodes_per_group);
+    }
+    int64_t bit = bit_find_clear(fs.inode_map, fs.inode_map_bits, start);
+    if (bit < 0) {
+        return 0;
     }
-    return 0;
+    fs.inode_cursor = bit + 1;
+
+	// mark inode allocated
+    bit_set(fs.inode_map, bit);
+    fs.n_inodes_free--;
+    int inum = bit_inode(bit);
+    count_group_inode(inum, -1, is_dir);
+
+    // mark inode map block dirty
+    int n = bit / BITS_PER_BLK;
+    fs.dirty[fs.inode_map_base + n] = (void*)fs.inode_map + n*FS_BLOCK_SIZE;
+    return inum;
 }
 
 /**
@@ -113,10 +412,13 @@ int get_free_inode(void)
 void return_inode(int inum)
 {
 	// mark inode free
-    FD_CLR(inum, fs.inode_map);
+    int64_t bit = inode_bit(inum);
+    bit_clear(fs.inode_map, bit);
+    fs.n_inodes_free++;
+    count_group_inode(inum, 1, S_ISDIR(fs.inodes[inum].mode));
 
     // mark inode map block dirty
-    int n = inum / BITS_PER_BLK;
+    int n = bit / BITS_PER_BLK;
     fs.dirty[fs.inode_map_base + n] = (void*)fs.inode_map + n*FS_BLOCK_SIZE;
 }
 
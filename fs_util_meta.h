@@ -11,24 +11,58 @@
 #ifndef FS_UTIL_META_H_
 #define FS_UTIL_META_H_
 
+#include "blkdev.h"
+
+/**
+ * Returns the device block number of a metadata block. Without
+ * block groups, metadata blocks are at the start of the device.
+ * With block groups, map and inode blocks are in their groups.
+ *
+ * @param i the metadata block number
+ * @return the device block number
+ */
+blkno_t meta_blkno(blkno_t i);
+
 /**
- * Flush dirty metadata blocks to disk.
+ * Flush dirty metadata blocks to disk, then discard blocks
+ * freed by the metadata updates.
  */
 void flush_metadata(void);
 
+/**
+ * Discard blocks freed since the last call, so the device can
+ * release their storage. Adjacent blocks are discarded with a
+ * single ranged request.
+ */
+void discard_freed_blks(void);
+
+/**
+ * Gets a run of contiguous free blocks from the free list. The
+ * run starts at the first free block at or after goal, and
+ * holds up to want blocks.
+ *
+ * @param want the number of blocks wanted
+ * @param goal the block number to start searching at, or 0
+ *   to continue after the last block allocated
+ * @param got the number of blocks allocated returned
+ * @return first free block number or 0 if none available
+ */
+blkno_t get_free_blks(int want, blkno_t goal, int *got);
+
 /**
  * Gets a free block number from the free list.
  *
  * @return free block number or 0 if none available
  */
-int get_free_blk(void);
+blkno_t get_free_blk(void);
 
 /**
- * Return a block to the free list.
+ * Return a block to the free list. The block is discarded
+ * with other freed blocks by discard_freed_blks().
  *
  * @param  blkno the block number
  */
-void return_blk(int blkno);
+void return_blk(blkno_t blkno);
 
 /**
  * Determines whether block with blkno is free.
@@ -36,15 +70,20 @@ void return_blk(int blkno);
  * @param blkno the block number
  * @param 1 (true) or 0 (false)
  */
-int is_free_blk(int blkno);
+int is_free_blk(blkno_t blkno);
 
 
 /**
- * Gets a free inode number from the free list.
+ * Gets a free inode number from the free list. With block
+ * groups, top-level directories spread over the volume and
+ * files stay near their directory. Otherwise the search starts
+ * after the last inode allocated.
  *
+ * @param dir_inum the inode number of the parent directory
+ * @param is_dir 1 if the new inode is a directory
  * @return a free inode number or 0 if none available
  */
-int get_free_inode(void);
+int get_free_inode(int dir_inum, int is_dir);
 
 /**
  * Return a inode to the free list.
@@ -62,6 +101,17 @@ void return_inode(int inum);
 int is_free_inode(int inum);
 
 
+/**
+ * Returns the block number to start searching at for blocks of
+ * an inode: the first block of the inode's block group, so data
+ * is kept near its inode. Without block groups, returns 0 to
+ * continue after the last block allocated.
+ *
+ * @param inum the inode number
+ * @return the block number to search from, or 0
+ */
+blkno_t inode_goal_blk(int inum);
+
 /**
  * Mark a inode as dirty.
  *
@@ -0,0 +1,246 @@
+/*
+ * fs_util_readahead.c
+ *
+ * description: sequential readahead for open files of CS 5600 / 7600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_util_file.h"
+#include "fs_util_readahead.h"
+#include "fs_util_vol.h"
+#include "blkbuf.h"
+#include "blkdev.h"
+#include "min.h"
+#include "max.h"
+
+/** smallest and largest readahead window in blocks */
+enum {RA_MIN_BLKS = 4, RA_MAX_BLKS = 256};
+
+/** readahead state of an open inode */
+struct read_ahead {
+    off_t next;                 // offset where the last read ended
+    int   window;               // readahead window in blocks, 0 if random
+    int   start;                // file block index of first buffered block
+    int   nblks;                // number of buffered blocks
+    char *buf;                  // buffered blocks, RA_MAX_BLKS long
+    int   nreqs;                // number of requests in flight
+    struct blkdev_req reqs[RA_MAX_BLKS];  // prefetch requests
+};
+
+/** readahead state by inode number, allocated on first read */
+static struct read_ahead **ra_inodes;
+
+/**
+ * Wait for prefetch requests of an inode to complete. If any
+ * fail, the buffered blocks are discarded.
+ *
+ * @param ra the readahead state
+ */
+static void ra_wait(struct read_ahead *ra)
+{
+    if (ra->nreqs > 0) {
+        if (blkdev_complete(disk, ra->reqs, ra->nreqs) != SUCCESS) {
+            ra->nblks = 0;
+        }
+        ra->nreqs = 0;
+    }
+}
+
+/**
+ * Get readahead state of an inode, allocating it if necessary.
+ *
+ * @param inum the inumber of inode
+ * @return the state or NULL if cannot be allocated
+ */
+static struct read_ahead *ra_get(int inum)
+{
+    if (ra_inodes == NULL) {
+        ra_inodes = calloc(fs.n_inodes, sizeof(struct read_ahead*));
+        if (ra_inodes == NULL) {
+            return NULL;
+        }
+    }
+    struct read_ahead *ra = ra_inodes[inum];
+    if (ra == NULL) {
+        ra = calloc(1, sizeof(struct read_ahead));
+        if (ra == NULL) {
+            return NULL;
+        }
+        if ((ra->buf = blkbuf_alloc(RA_MAX_BLKS)) == NULL) {
+            free(ra);
+            return NULL;
+        }
+        ra_inodes[inum] = ra;
+    }
+    return ra;
+}
+
+/**
+ * Start prefetching a window of file blocks into the buffer.
+ * Blocks are resolved through the file block map, stopping at
+ * the end of the file, and runs of physically contiguous blocks
+ * are submitted as single requests without waiting for them.
+ *
+ * @param inum the inumber of inode
+ * @param ra the readahead state
+ * @param first the file block index of first block to prefetch
+ */
+static void ra_prefetch(int inum, struct read_ahead *ra, int first)
+{
+    ra_wait(ra);
+    ra->start = first;
+    ra->nblks = 0;
+
+    int size_blks = (fs.inodes[inum].size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    int n = min(ra->window, size_blks - first);
+    blkno_t blknos[RA_MAX_BLKS];
+    for (int i = 0; i < n; i++) {
+        if ((blknos[i] = get_file_blkno(inum, first + i, 0)) <= 0) {
+            n = i;
+        }
+    }
+
+    for (int i = 0; i < n; ) {
+        int len = 1;
+        while (i+len < n && blknos[i+len] == blknos[i]+len) {
+            len++;
+        }
+        ra->reqs[ra->nreqs++] = (struct blkdev_req) {
+            .op = BLKDEV_READ, .first_blk = blknos[i],
+            .num_blks = len, .buf = ra->buf + i*FS_BLOCK_SIZE
+        };
+        i += len;
+    }
+    if (blkdev_submit(disk, ra->reqs, ra->nreqs) != SUCCESS) {
+        ra->nreqs = 0;
+        return;
+    }
+    ra->nblks = n;
+}
+
+/**
+ * Read bytes from content of an open inode with readahead.
+ * Reads that continue where the previous read of the inode
+ * ended are sequential: each one grows the readahead window and
+ * starts prefetching the window of blocks that follow it. Later
+ * reads are served from the prefetched blocks. A read anywhere
+ * else collapses the window and discards prefetched blocks.
+ *
+ * Same results and errors as do_read().
+ *
+ * @param inum the inumber of inode to read
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @param offset to start reading at
+ * @return number of bytes actually read if successful, or -error number
+ */
+int do_read_ahead(int inum, char* buf, size_t len, off_t offset)
+{
+    off_t size = file_size(inum);
+    if (offset >= size || len == 0) {
+        return 0;
+    }
+    if ((off_t)len > size - offset) {
+        len = size - offset;
+    }
+
+    struct read_ahead *ra = ra_get(inum);
+    if (ra == NULL) {
+        return do_read(inum, buf, len, offset);
+    }
+
+    // index of first and last block
+    int blkidx1 = offset / FS_BLOCK_SIZE;
+    int blkidx2 = (offset + len - 1) / FS_BLOCK_SIZE;
+    int nblks = blkidx2 - blkidx1 + 1;
+
+    // grow window on sequential access, collapse it otherwise
+    if (offset == ra->next) {
+        ra->window = min(RA_MAX_BLKS, max(max(RA_MIN_BLKS, 2*nblks), 2*ra->window));
+    } else {
+        ra_wait(ra);
+        ra->window = 0;
+        ra->nblks = 0;
+    }
+    ra->next = offset + len;
+
+    // copy leading blocks that are buffered; a failed prefetch
+    // discards them, so check again once it is done
+    size_t nread = 0;
+    if (ra->nblks > 0 && blkidx1 >= ra->start && blkidx1 < ra->start + ra->nblks) {
+        ra_wait(ra);
+    }
+    if (ra->nblks > 0 && blkidx1 >= ra->start && blkidx1 < ra->start + ra->nblks) {
+        off_t pos = offset - (off_t)ra->start * FS_BLOCK_SIZE;
+        size_t avail = (size_t)ra->nblks * FS_BLOCK_SIZE - pos;
+        nread = (len < avail) ? len : avail;
+        memcpy(buf, ra->buf + pos, nread);
+    }
+
+    // start next window if this read reaches its end
+    int next_blk = ra->next / FS_BLOCK_SIZE;
+    if (ra->window > 0 && next_blk + nblks > ra->start + ra->nblks) {
+        ra_prefetch(inum, ra, next_blk);
+    }
+
+    // read the rest directly
+    if (nread < len) {
+        int val = do_read(inum, buf + nread, len - nread, offset + nread);
+        if (val < 0) {
+            return val;
+        }
+        nread += val;
+    }
+    return nread;
+}
+
+/**
+ * Discard prefetched blocks of an inode whose content or
+ * block map is about to change.
+ *
+ * @param inum the inumber of inode
+ */
+void invalidate_read_ahead(int inum)
+{
+    if (ra_inodes != NULL && ra_inodes[inum] != NULL) {
+        ra_wait(ra_inodes[inum]);
+        ra_inodes[inum]->nblks = 0;
+    }
+}
+
+/**
+ * Release readahead state of an inode when it is closed.
+ *
+ * @param inum the inumber of inode
+ */
+void release_read_ahead(int inum)
+{
+    if (ra_inodes != NULL && ra_inodes[inum] != NULL) {
+        struct read_ahead *ra = ra_inodes[inum];
+        ra_wait(ra);
+        blkbuf_free(ra->buf, RA_MAX_BLKS);
+        free(ra);
+        ra_inodes[inum] = NULL;
+    }
+}
+
+/**
+ * Release readahead state of all inodes before the block
+ * device is closed.
+ */
+void destroy_read_ahead(void)
+{
+    if (ra_inodes != NULL) {
+        for (int inum = 0; inum < fs.n_inodes; inum++) {
+            release_read_ahead(inum);
+        }
+        free(ra_inodes);
+        ra_inodes = NULL;
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * fs_util_readahead.h
+ *
+ * description: sequential readahead for open files of CS 5600 / 7600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef FS_UTIL_READAHEAD_H_
+#define FS_UTIL_READAHEAD_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/**
+ * Read bytes from content of an open inode with readahead.
+ * Reads that continue where the previous read of the inode
+ * ended are sequential: each one grows the readahead window and
+ * starts prefetching the window of blocks that follow it. Later
+ * reads are served from the prefetched blocks. A read anywhere
+ * else collapses the window and discards prefetched blocks.
+ *
+ * Same results and errors as do_read().
+ *
+ * @param inum the inumber of inode to read
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @param offset to start reading at
+ * @return number of bytes actually read if successful, or -error number
+ */
+int do_read_ahead(int inum, char* buf, size_t len, off_t offset);
+
+/**
+ * Discard prefetched blocks of an inode whose content or
+ * block map is about to change.
+ *
+ * @param inum the inumber of inode
+ */
+void invalidate_read_ahead(int inum);
+
+/**
+ * Release readahead state of an inode when it is closed.
+ *
+ * @param inum the inumber of inode
+ */
+void release_read_ahead(int inum);
+
+/**
+ * Release readahead state of all inodes before the block
+ * device is closed.
+ */
+void destroy_read_ahead(void);
+
+#endif /* FS_UTIL_READAHEAD_H_ */
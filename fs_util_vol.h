@@ -11,9 +11,9 @@
 #ifndef FS_UTIL_VOL_H_
 #define FS_UTIL_VOL_H_
 
-#include <sys/select.h>
-
 #include "fsx600.h"
+#include "blkdev.h"
+#include "bitmap.h"
 
 /**
  * disk access - the global variable 'disk' points to a blkdev
@@ -26,20 +26,24 @@ extern struct blkdev *disk;
 
 /** information about ext2 fs volume */
 struct ext2_fs {
-	/** number of metadata blocks */
-	int n_meta;
+	/** number of metadata blocks: superblock, group descriptors,
+	 *  inode map, block map and inode blocks, in that order */
+	blkno_t n_meta;
 
-	/** blkno of first inode map block */
-	int inode_map_base;
+	/** metadata block number of first inode map block */
+	blkno_t inode_map_base;
 
 	/** pointer to inode bitmap to determine free inodes */
-	fd_set *inode_map;
+	bitmap_t *inode_map;
 
 	/** number of inodes from superblock */
 	int n_inodes;
 
-	/** blkno of first inode block */
-	int inode_base;
+	/** number of free inodes */
+	int n_inodes_free;
+
+	/** metadata block number of first inode block */
+	blkno_t inode_base;
 
 	/** pointer to inode blocks */
 	struct fs_inode *inodes;
@@ -47,14 +51,43 @@ struct ext2_fs {
 	/** number of root inode from superblock */
 	int root_inode;
 
-	/** blkno of first data block */
-	int block_map_base;
+	/** metadata block number of first block map block */
+	blkno_t block_map_base;
 
 	/** pointer to block bitmap to determine free blocks */
-	fd_set *block_map;
+	bitmap_t *block_map;
 
 	/** number of available blocks from superblock */
-	int n_blocks;
+	blkno_t n_blocks;
+
+	/** number of free blocks */
+	blkno_t n_blocks_free;
+
+	/** number of blocks written but not yet allocated, with the
+	 *  indirect blocks they will need */
+	blkno_t n_blocks_delayed;
+
+	/** inode number to start the next free inode search at */
+	int inode_cursor;
+
+	/** block number to start the next free block search at */
+	blkno_t block_cursor;
+
+	/** number of block groups, 0 if no block groups */
+	int n_groups;
+
+	/** number of inodes per block group */
+	int inodes_per_group;
+
+	/** number of blocks per block group */
+	blkno_t blocks_per_group;
+
+	/** pointer to group descriptor blocks */
+	struct fs_group_desc *groups;
+
+	/** number of bits in inode map: with block groups, each
+	 *  group has a map block whose bits past its inodes are set */
+	int64_t inode_map_bits;
 
 	/** array of dirty metadata blocks to write */
 	void **dirty;
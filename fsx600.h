@@ -38,11 +38,32 @@ struct fs_super {
     uint32_t block_map_sz;		/** block map size in blocks */
     uint32_t num_blocks;		/** total blocks, including SB, bitmaps, inodes */
     uint32_t root_inode;		/** always inode 1 */
+    uint32_t blocks_per_group;	/** blocks per group, 0 if no block groups */
+    uint32_t inodes_per_group;	/** inodes per group */
+    uint32_t group_desc_sz;		/** group descriptor table size in blocks */
 
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 9 * sizeof(uint32_t)]; 
 };								/** total FS_BLOCK_SIZE bytes */
 
+/**
+ * Block group descriptor - locates the maps and inode table of
+ * a group. With block groups, the volume is divided into groups
+ * of BITS_PER_BLK blocks, each with a one block block map, a one
+ * block inode map and an inode table. The descriptor table
+ * follows the superblock; the inode map, block map and inode
+ * region sizes in the superblock are the totals of all groups.
+ */
+struct fs_group_desc {
+    uint32_t block_map;			/** blkno of group block map */
+    uint32_t inode_map;			/** blkno of group inode map */
+    uint32_t inode_table;		/** blkno of first group inode block */
+    uint32_t free_blocks;		/** number of free blocks in group */
+    uint32_t free_inodes;		/** number of free inodes in group */
+    uint32_t n_dirs;			/** number of directories in group */
+    uint32_t pad[2];			/** 32 bytes per descriptor */
+};
+
 /**
  * Inode - holds file entry information
  */
@@ -68,12 +89,14 @@ struct fs_inode {
  *   INODES_PER_BLOCK  - number of inodes per block
  *   PTRS_PER_BLOCK    - number of inode pointers per block
  *   BITS_PER_BLOCK    - number of bits per block
+ *   GROUP_DESCS_PER_BLK - number of group descriptors per block
  */
 enum {
     DIRENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent), /** directory entries per block */
 	INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode),	/** inodes per block */
     PTRS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t),			/** inode pointers per block */
-	BITS_PER_BLK = FS_BLOCK_SIZE * 8							/** bits per block */
+	BITS_PER_BLK = FS_BLOCK_SIZE * 8,							/** bits per block */
+	GROUP_DESCS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_group_desc)	/** group descriptors per block */
 };
 
 #endif  /* __FSX600_H__ */
@@ -7,9 +7,11 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE		/* for preadv, pwritev, O_DIRECT and fallocate */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
@@ -18,8 +20,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
+#include "aio.h"
+#include "blkbuf.h"
 #include "blkdev.h"
+#include "image.h"
 
 // should be defined in "string.h" but is not on macos
 extern char* strdup(const char *);
@@ -28,16 +35,29 @@ extern char* strdup(const char *);
 struct image_dev {
     char *path;		// path to device file
     int   fd;		// file descriptor of open file
-    int   nblks;	// number of blocks in device
+    blkno_t nblks;	// number of blocks in device
+    char *map;		// mapped image file, or NULL if not mapped
+    struct aio *aio;	// asynchronous I/O context, or NULL if none
+    int   direct;	// 1 if opened with O_DIRECT
+
+    /* group commit: callers that flush together share one fdatasync */
+    pthread_mutex_t sync_lock;	// protects sync state
+    pthread_cond_t  sync_cond;	// signals completion of a sync
+    unsigned long   sync_req;	// number of syncs requested
+    unsigned long   sync_done;	// requests covered by completed syncs
+    int   syncing;	// 1 while a sync is in progress
 };
 
+/** maximum number of asynchronous requests in flight */
+enum {IMAGE_QUEUE_DEPTH = 64};
+
 
 /**
  * The number of blocks in the block device.
  *
  * @param the block device
  */
-static int image_num_blocks(struct blkdev *dev)
+static blkno_t image_num_blocks(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     return im->nblks;
@@ -52,7 +72,7 @@ static int image_num_blocks(struct blkdev *dev)
  * @param buf the input buffer
  * @return SUCCESS if successful, E_UNAVAIL if device unavailable
  */
-static int image_read(struct blkdev *dev, int offset, int len, void *buf)
+static int image_read(struct blkdev *dev, blkno_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
@@ -62,7 +82,19 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
     }
     assert(offset >= 0 && offset+len <= im->nblks);
 
-    ssize_t result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    /* O_DIRECT needs an aligned buffer: read through one */
+    if (im->direct && !blkbuf_aligned(buf)) {
+        void *tmp = blkbuf_alloc(len);
+        if (tmp == NULL) {
+            return E_UNAVAIL;
+        }
+        int val = image_read(dev, offset, len, tmp);
+        memcpy(buf, tmp, len*BLOCK_SIZE);
+        blkbuf_free(tmp, len);
+        return val;
+    }
+
+    ssize_t result = pread(im->fd, buf, (size_t)len*BLOCK_SIZE, (off_t)offset*BLOCK_SIZE);
 
     /* Since I'm not asking for the code that calls this to handle
      * errors other than E_BADADDR and E_UNAVAIL, we report errors and
@@ -91,7 +123,7 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
  * @param buf the output buffer
  * @return SUCCESS if successful, E_UNAVAIL if device unavailable
  */
-static int image_write(struct blkdev * dev, int offset, int len, void *buf)
+static int image_write(struct blkdev * dev, blkno_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
@@ -103,8 +135,155 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
         return E_UNAVAIL;
 
      assert(offset >= 0 && offset+len <= im->nblks);
+
+    /* O_DIRECT needs an aligned buffer: write through one */
+    if (im->direct && !blkbuf_aligned(buf)) {
+        void *tmp = blkbuf_alloc(len);
+        if (tmp == NULL) {
+            return E_UNAVAIL;
+        }
+        memcpy(tmp, buf, len*BLOCK_SIZE);
+        int val = image_write(dev, offset, len, tmp);
+        blkbuf_free(tmp, len);
+        return val;
+    }
     
-    ssize_t result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    ssize_t result = pwrite(im->fd, buf, (size_t)len*BLOCK_SIZE, (off_t)offset*BLOCK_SIZE);
+
+    /* again, report the error and then exit with an assert
+     */
+    if (result != len*BLOCK_SIZE) {
+        fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Total number of blocks in a vector of buffers.
+ *
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return the number of blocks
+ */
+static int iov_blocks(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len / BLOCK_SIZE;
+}
+
+/**
+ * Determines whether all buffers of a vector are aligned for
+ * O_DIRECT transfers.
+ *
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return 1 (true) if all aligned, 0 (false) otherwise
+ */
+static int iov_aligned(const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        if (!blkbuf_aligned(iov[i].iov_base)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read blocks from block device starting at give block offset
+ * into several buffers with a single system call.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param iov the input buffers, each a multiple of BLOCK_SIZE bytes
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_readv(struct blkdev *dev, blkno_t offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    int len = iov_blocks(iov, iovcnt);
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    /* O_DIRECT needs aligned buffers: read all blocks into one */
+    if (im->direct && !iov_aligned(iov, iovcnt)) {
+        char *tmp = blkbuf_alloc(len);
+        if (tmp == NULL) {
+            return E_UNAVAIL;
+        }
+        int val = image_read(dev, offset, len, tmp);
+        for (int i = 0, pos = 0; i < iovcnt; pos += iov[i++].iov_len) {
+            memcpy(iov[i].iov_base, tmp + pos, iov[i].iov_len);
+        }
+        blkbuf_free(tmp, len);
+        return val;
+    }
+
+    ssize_t result = preadv(im->fd, iov, iovcnt, (off_t)offset*BLOCK_SIZE);
+
+    /* report errors and then exit, as image_read() does */
+    if (result < 0) {
+        fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+
+    if (result != len*BLOCK_SIZE) {
+        fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Write blocks to block device starting at give block offset
+ * from several buffers with a single system call.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param iov the output buffers, each a multiple of BLOCK_SIZE bytes
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_writev(struct blkdev *dev, blkno_t offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    if (offset == 0)
+        printf("ERROR? write to sector 0\n");
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    int len = iov_blocks(iov, iovcnt);
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    /* O_DIRECT needs aligned buffers: write all blocks from one */
+    if (im->direct && !iov_aligned(iov, iovcnt)) {
+        char *tmp = blkbuf_alloc(len);
+        if (tmp == NULL) {
+            return E_UNAVAIL;
+        }
+        for (int i = 0, pos = 0; i < iovcnt; pos += iov[i++].iov_len) {
+            memcpy(tmp + pos, iov[i].iov_base, iov[i].iov_len);
+        }
+        int val = image_write(dev, offset, len, tmp);
+        blkbuf_free(tmp, len);
+        return val;
+    }
+
+    ssize_t result = pwritev(im->fd, iov, iovcnt, (off_t)offset*BLOCK_SIZE);
 
     /* again, report the error and then exit with an assert
      */
@@ -117,15 +296,197 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
 }
 
 /**
- * Flush the block device.
+ * Make all written blocks durable with fdatasync. Callers that
+ * arrive while a sync is in progress wait for it to finish, and
+ * then share a single further sync that covers all of them.
+ *
+ * @param im the image device
+ * @return SUCCESS if successful
+ */
+static int image_group_sync(struct image_dev *im)
+{
+    pthread_mutex_lock(&im->sync_lock);
+    unsigned long ticket = ++im->sync_req;
+    while (im->sync_done < ticket) {
+        if (im->syncing) {
+            /* sync in progress may predate our writes: wait for it */
+            pthread_cond_wait(&im->sync_cond, &im->sync_lock);
+            continue;
+        }
+
+        /* lead a sync for all requests made so far */
+        unsigned long covered = im->sync_req;
+        im->syncing = 1;
+        pthread_mutex_unlock(&im->sync_lock);
+
+        int result = fdatasync(im->fd);
+
+        pthread_mutex_lock(&im->sync_lock);
+        im->syncing = 0;
+        pthread_cond_broadcast(&im->sync_cond);
+        if (result < 0) {
+            /* report the error and then exit with an assert */
+            fprintf(stderr, "sync error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        im->sync_done = covered;
+    }
+    pthread_mutex_unlock(&im->sync_lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Flush the block device. Flushing the whole device makes all
+ * writes durable, sharing one fdatasync among concurrent callers.
+ * Flushing part of the device writes the range to storage with
+ * sync_file_range, which does not flush the storage write cache.
  *
  * @param dev the block device
- * @aparam offset starting byte offset
- * @param len number of bytes to flush
+ * @param offset starting block offset
+ * @param len number of blocks to flush
  * @return SUCCESS if successful, E_UNAVAIL if device unavailable
  */
-static int image_flush(struct blkdev * dev, int offset, int len)
+static int image_flush(struct blkdev * dev, blkno_t offset, blkno_t len)
 {
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    if (offset <= 0 && offset+len >= im->nblks)
+        return image_group_sync(im);
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+    if (sync_file_range(im->fd, (off_t)offset*BLOCK_SIZE, (off_t)len*BLOCK_SIZE,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+        fprintf(stderr, "sync error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Start block device requests without waiting for them.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    for (int i = 0; i < nreqs; i++) {
+        assert(reqs[i].first_blk >= 0 && reqs[i].first_blk+reqs[i].num_blks <= im->nblks);
+        if (reqs[i].op == BLKDEV_WRITE && reqs[i].first_blk == 0)
+            printf("ERROR? write to sector 0\n");
+    }
+    if (!im->direct)
+        return aio_submit(im->aio, reqs, nreqs);
+
+    /* O_DIRECT: requests with unaligned buffers are done now,
+     * through aligned buffers; the rest are queued in runs.
+     */
+    int val = SUCCESS;
+    for (int i = 0, first = 0; i <= nreqs && val == SUCCESS; i++) {
+        struct blkdev_req *r = &reqs[i];
+        if (i < nreqs && (r->iov != NULL ? iov_aligned(r->iov, r->iovcnt)
+                                         : blkbuf_aligned(r->buf)))
+            continue;
+        if (i > first)
+            val = aio_submit(im->aio, &reqs[first], i - first);
+        first = i+1;
+        if (i < nreqs) {
+            if (r->iov != NULL) {
+                r->status = (r->op == BLKDEV_WRITE)
+                    ? image_writev(dev, r->first_blk, r->iov, r->iovcnt)
+                    : image_readv(dev, r->first_blk, r->iov, r->iovcnt);
+            } else {
+                r->status = (r->op == BLKDEV_WRITE)
+                    ? image_write(dev, r->first_blk, r->num_blks, r->buf)
+                    : image_read(dev, r->first_blk, r->num_blks, r->buf);
+            }
+            r->done = 1;
+        }
+    }
+    return val;
+}
+
+/**
+ * Wait for submitted block device requests to complete.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or the first error
+ */
+static int image_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct image_dev *im = dev->private;
+    return aio_complete(im->aio, reqs, nreqs);
+}
+
+/**
+ * Discard blocks of the block device by punching a hole in the
+ * image file, so a sparse image shrinks. File systems without
+ * hole punching leave the blocks unchanged.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to discard
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_discard(struct blkdev *dev, blkno_t offset, blkno_t len)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)offset*BLOCK_SIZE, (off_t)len*BLOCK_SIZE) < 0
+        && errno != EOPNOTSUPP && errno != ENOSYS) {
+        fprintf(stderr, "discard error on %s: %s\n", im->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Prefetch blocks of the block device by advising the host that
+ * they will be needed, so it reads them into its page cache in
+ * the background. O_DIRECT reads bypass the page cache, so
+ * blocks are not prefetched for them.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to prefetch
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_prefetch(struct blkdev *dev, blkno_t offset, int len)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    if (!im->direct) {
+        posix_fadvise(im->fd, (off_t)offset*BLOCK_SIZE, (off_t)len*BLOCK_SIZE,
+                      POSIX_FADV_WILLNEED);
+    }
     return SUCCESS;
 }
 
@@ -139,9 +500,14 @@ static void image_close(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
 
+    if (im->aio != NULL) {
+        aio_close(im->aio);
+    }
     if (im->fd != -1) {
         close(im->fd);
     }
+    pthread_cond_destroy(&im->sync_cond);
+    pthread_mutex_destroy(&im->sync_lock);
     free(im);
     dev->private = NULL;        /* crash any attempts to access */
     free(dev);
@@ -153,27 +519,41 @@ static struct blkdev_ops image_ops = {
     .read = image_read,
     .write = image_write,
     .flush = image_flush,
-    .close = image_close
+    .close = image_close,
+    .readv = image_readv,
+    .writev = image_writev,
+    .submit = image_submit,
+    .complete = image_complete,
+    .discard = image_discard,
+    .prefetch = image_prefetch
 };
 
 /**
- * Create an image block device reading from a specified image file.
+ * Open image file and initialize image device state.
  *
  * @param path the path to the image file
- * @return the block device or NULL if cannot open or read image file
+ * @param flags additional open flags: 0 or O_DIRECT
+ * @return the image device state or NULL if cannot open or read image file
  */
-struct blkdev *image_create(char *path)
+static struct image_dev *image_open(char *path, int flags)
 {
-    struct blkdev *dev = malloc(sizeof(*dev));
     struct image_dev *im = malloc(sizeof(*im));
-
-    if (dev == NULL || im == NULL)
+    if (im == NULL)
         return NULL;
 
     im->path = strdup(path);    /* save a copy for error reporting */
-    
-    /* open image device */
-    im->fd = open(path, O_RDWR);
+    im->map = NULL;
+    im->aio = NULL;
+    im->direct = (flags & O_DIRECT) != 0;
+    pthread_mutex_init(&im->sync_lock, NULL);
+    pthread_cond_init(&im->sync_cond, NULL);
+    im->sync_req = im->sync_done = 0;
+    im->syncing = 0;
+
+    /* open image device, read-only if it cannot be written */
+    im->fd = open(path, O_RDWR | flags);
+    if (im->fd < 0 && (errno == EACCES || errno == EROFS))
+        im->fd = open(path, O_RDONLY | flags);
     if (im->fd < 0) {
         fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
         return NULL;
@@ -195,12 +575,505 @@ struct blkdev *image_create(char *path)
                 path, BLOCK_SIZE);
     }
     im->nblks = sb.st_size / BLOCK_SIZE;
+
+    return im;
+}
+
+/**
+ * Create an image block device reading from a specified image
+ * file opened with additional flags.
+ *
+ * @param path the path to the image file
+ * @param flags additional open flags: 0 or O_DIRECT
+ * @return the block device or NULL if cannot open or read image file
+ */
+static struct blkdev *image_create_flags(char *path, int flags)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    if (dev == NULL)
+        return NULL;
+
+    struct image_dev *im = image_open(path, flags);
+    if (im == NULL)
+        return NULL;
+
+    /* requests submitted asynchronously are queued here */
+    im->aio = aio_create(im->fd, IMAGE_QUEUE_DEPTH);
+    if (im->aio == NULL) {
+        fprintf(stderr, "can't create I/O queue for %s\n", path);
+        return NULL;
+    }
+
     dev->private = im;
     dev->ops = &image_ops;
 
     return dev;
 }
 
+/**
+ * Create an image block device reading from a specified image file.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or read image file
+ */
+struct blkdev *image_create(char *path)
+{
+    return image_create_flags(path, 0);
+}
+
+/**
+ * Create an image block device reading from a specified image
+ * file opened with O_DIRECT, bypassing the host page cache.
+ * Transfers from buffers not aligned to BLKBUF_ALIGN go through
+ * aligned buffers from the block buffer pool.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or read image file
+ */
+struct blkdev *image_create_direct(char *path)
+{
+    return image_create_flags(path, O_DIRECT);
+}
+
+/**
+ * Read blocks from mapped block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_read(struct blkdev *dev, blkno_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    memcpy(buf, im->map + (size_t)offset*BLOCK_SIZE, (size_t)len*BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Write blocks to mapped block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_write(struct blkdev *dev, blkno_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    if (offset == 0)
+        printf("ERROR? write to sector 0\n");
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    memcpy(im->map + (size_t)offset*BLOCK_SIZE, buf, (size_t)len*BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Flush blocks of the mapped block device to the image file.
+ * The range is widened to page boundaries as msync requires.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_flush(struct blkdev *dev, blkno_t offset, blkno_t len)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    if (offset < 0)
+        offset = 0;
+    if (len <= 0 || offset+len > im->nblks)
+        len = im->nblks - offset;
+    if (len <= 0)
+        return SUCCESS;
+
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)offset*BLOCK_SIZE & ~(pgsz-1);
+    size_t end = (size_t)(offset+len)*BLOCK_SIZE;
+
+    if (msync(im->map + start, end - start, MS_SYNC) < 0) {
+        fprintf(stderr, "msync error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Prefetch blocks of the mapped block device by advising the
+ * host to page in their part of the mapping.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to prefetch
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_prefetch(struct blkdev *dev, blkno_t offset, int len)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)offset*BLOCK_SIZE & ~(pgsz-1);
+    size_t end = (size_t)(offset+len)*BLOCK_SIZE;
+    madvise(im->map + start, end - start, MADV_WILLNEED);
+    return SUCCESS;
+}
+
+/**
+ * Close the mapped block device. Unmapping writes back all
+ * modified pages. After this any further access to that
+ * device will return E_UNAVAIL.
+ *
+ * @param dev the block device
+ */
+static void image_mmap_close(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->map != NULL) {
+        munmap(im->map, (size_t)im->nblks*BLOCK_SIZE);
+    }
+    image_close(dev);
+}
+
+/** Operations on a mapped block device */
+static struct blkdev_ops image_mmap_ops = {
+    .num_blocks = image_num_blocks,
+    .read = image_mmap_read,
+    .write = image_mmap_write,
+    .flush = image_mmap_flush,
+    .close = image_mmap_close,
+    .discard = image_discard,
+    .prefetch = image_mmap_prefetch
+};
+
+/**
+ * Create an image block device that maps a specified image
+ * file into memory. Reads and writes are memory copies, and
+ * flush writes modified pages back to the image file.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or map image file
+ */
+struct blkdev *image_create_mmap(char *path)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    if (dev == NULL)
+        return NULL;
+
+    struct image_dev *im = image_open(path, 0);
+    if (im == NULL)
+        return NULL;
+
+    im->map = mmap(NULL, (size_t)im->nblks*BLOCK_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_SHARED, im->fd, 0);
+    if (im->map == MAP_FAILED) {
+        fprintf(stderr, "can't map image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    dev->private = im;
+    dev->ops = &image_mmap_ops;
+
+    return dev;
+}
+
+/** definition of RAM disk block device */
+struct ram_dev {
+    char *path;		// path to image file, or NULL if none
+    int   fd;		// file descriptor of image file, or -1 if none
+    blkno_t nblks;	// number of blocks in device
+    char *mem;		// device content
+    size_t len;		// length of mapped region
+    int   save;		// 1 if modified blocks are saved to the image file
+    unsigned char *dirty;	// 1 bit per block modified since last save
+    pthread_mutex_t lock;	// serializes saves
+};
+
+/**
+ * The number of blocks in the RAM disk.
+ *
+ * @param dev the block device
+ */
+static blkno_t ram_num_blocks(struct blkdev *dev)
+{
+    struct ram_dev *rd = dev->private;
+    return rd->nblks;
+}
+
+/**
+ * Read blocks from RAM disk starting at give block offset.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int ram_read(struct blkdev *dev, blkno_t offset, int len, void *buf)
+{
+    struct ram_dev *rd = dev->private;
+
+    if (offset < 0 || len < 0 || offset+len > rd->nblks)
+        return E_BADADDR;
+
+    memcpy(buf, rd->mem + (size_t)offset*BLOCK_SIZE, (size_t)len*BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Mark RAM disk blocks modified since the last save.
+ *
+ * @param rd the RAM disk
+ * @param offset starting block offset
+ * @param len number of blocks
+ */
+static void ram_mark_dirty(struct ram_dev *rd, blkno_t offset, int len)
+{
+    if (rd->save) {
+        for (blkno_t i = offset; i < offset+len; i++) {
+            __atomic_or_fetch(&rd->dirty[i/8], 1 << (i%8), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Write blocks to RAM disk starting at give block offset.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int ram_write(struct blkdev *dev, blkno_t offset, int len, void *buf)
+{
+    struct ram_dev *rd = dev->private;
+
+    if (offset < 0 || len < 0 || offset+len > rd->nblks)
+        return E_BADADDR;
+
+    memcpy(rd->mem + (size_t)offset*BLOCK_SIZE, buf, (size_t)len*BLOCK_SIZE);
+    ram_mark_dirty(rd, offset, len);
+    return SUCCESS;
+}
+
+/**
+ * Discard blocks of the RAM disk: they become 0s.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to discard
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int ram_discard(struct blkdev *dev, blkno_t offset, blkno_t len)
+{
+    struct ram_dev *rd = dev->private;
+
+    if (offset < 0 || len < 0 || offset+len > rd->nblks)
+        return E_BADADDR;
+
+    memset(rd->mem + (size_t)offset*BLOCK_SIZE, 0, (size_t)len*BLOCK_SIZE);
+    ram_mark_dirty(rd, offset, len);
+    return SUCCESS;
+}
+
+/**
+ * Flush the RAM disk. If saving, blocks in the range modified
+ * since the last save are written to the image file, each run
+ * of modified blocks with one write, and the file is synced.
+ *
+ * @param dev the block device
+ * @param offset starting block offset
+ * @param len number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if cannot save
+ */
+static int ram_flush(struct blkdev *dev, blkno_t offset, blkno_t len)
+{
+    struct ram_dev *rd = dev->private;
+
+    if (!rd->save)
+        return SUCCESS;
+
+    if (offset < 0)
+        offset = 0;
+    if (offset+len > rd->nblks)
+        len = rd->nblks - offset;
+
+    pthread_mutex_lock(&rd->lock);
+    int val = SUCCESS, nsaved = 0;
+    for (blkno_t i = offset; i < offset+len && val == SUCCESS; ) {
+        if (!(rd->dirty[i/8] & (1 << (i%8)))) {
+            i++;
+            continue;
+        }
+        int n = 0;
+        while (i+n < offset+len && (rd->dirty[(i+n)/8] & (1 << ((i+n)%8)))) {
+            __atomic_and_fetch(&rd->dirty[(i+n)/8], ~(1 << ((i+n)%8)), __ATOMIC_RELAXED);
+            n++;
+        }
+        size_t nbytes = (size_t)n*BLOCK_SIZE;
+        if (pwrite(rd->fd, rd->mem + (size_t)i*BLOCK_SIZE, nbytes,
+                   (off_t)i*BLOCK_SIZE) != (ssize_t)nbytes) {
+            fprintf(stderr, "write error on %s: %s\n", rd->path, strerror(errno));
+            ram_mark_dirty(rd, i, n);
+            val = E_UNAVAIL;
+        }
+        nsaved += n;
+        i += n;
+    }
+    if (val == SUCCESS && nsaved > 0 && fdatasync(rd->fd) < 0) {
+        fprintf(stderr, "sync error on %s: %s\n", rd->path, strerror(errno));
+        val = E_UNAVAIL;
+    }
+    pthread_mutex_unlock(&rd->lock);
+
+    return val;
+}
+
+/**
+ * Close the RAM disk, saving modified blocks if saving.
+ *
+ * @param dev the block device
+ */
+static void ram_close(struct blkdev *dev)
+{
+    struct ram_dev *rd = dev->private;
+
+    ram_flush(dev, 0, rd->nblks);
+    munmap(rd->mem, rd->len);
+    if (rd->fd != -1) {
+        close(rd->fd);
+    }
+    pthread_mutex_destroy(&rd->lock);
+    free(rd->dirty);
+    free(rd->path);
+    free(rd);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/** Operations on a RAM disk */
+static struct blkdev_ops ram_ops = {
+    .num_blocks = ram_num_blocks,
+    .read = ram_read,
+    .write = ram_write,
+    .flush = ram_flush,
+    .close = ram_close,
+    .discard = ram_discard
+};
+
+/**
+ * Map an anonymous region for a RAM disk. With huge pages, the
+ * region is first mapped from the huge page pool, and otherwise
+ * marked as a candidate for transparent huge pages.
+ *
+ * @param len the length of the region
+ * @param hugepages 1 to use huge pages if possible
+ * @return the region or MAP_FAILED if cannot be mapped
+ */
+static void *ram_map(size_t *len, int hugepages)
+{
+    void *mem = MAP_FAILED;
+    if (hugepages) {
+        size_t hlen = (*len + (2<<20) - 1) & ~(size_t)((2<<20) - 1);
+        mem = mmap(NULL, hlen, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *len = hlen;
+            return mem;
+        }
+    }
+    mem = mmap(NULL, *len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED && hugepages) {
+        madvise(mem, *len, MADV_HUGEPAGE);
+    }
+    return mem;
+}
+
+/**
+ * Create a RAM disk block device that keeps all blocks in an
+ * anonymous memory region. If path is not NULL, the device has
+ * the size and content of the image file; otherwise it has
+ * nblks blocks of 0s. With RAM_SAVE, blocks modified since
+ * the last save are written back to the image file on flush
+ * and close; otherwise changes are lost on close.
+ *
+ * @param path the path to the image file to load, or NULL
+ * @param nblks the number of blocks if path is NULL
+ * @param flags RAM_SAVE and RAM_HUGEPAGES, or 0
+ * @return the block device or NULL if cannot allocate or load
+ */
+struct blkdev *image_create_ram(char *path, blkno_t nblks, int flags)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct ram_dev *rd = calloc(1, sizeof(*rd));
+    if (dev == NULL || rd == NULL)
+        return NULL;
+
+    rd->fd = -1;
+    if (path != NULL) {
+        rd->path = strdup(path);    /* save a copy for error reporting */
+        rd->fd = open(path, (flags & RAM_SAVE) ? O_RDWR : O_RDONLY);
+        struct stat sb;
+        if (rd->fd < 0 || fstat(rd->fd, &sb) < 0) {
+            fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        nblks = sb.st_size / BLOCK_SIZE;
+        rd->save = (flags & RAM_SAVE) != 0;
+    }
+    rd->nblks = nblks;
+    rd->len = (size_t)nblks*BLOCK_SIZE;
+
+    rd->mem = ram_map(&rd->len, (flags & RAM_HUGEPAGES) != 0);
+    rd->dirty = calloc((nblks + 7) / 8, 1);
+    if (rd->mem == MAP_FAILED || rd->dirty == NULL) {
+        fprintf(stderr, "can't allocate %lld block RAM disk\n", (long long)nblks);
+        return NULL;
+    }
+
+    /* load image content */
+    for (size_t off = 0; rd->fd != -1 && off < (size_t)nblks*BLOCK_SIZE; ) {
+        ssize_t n = pread(rd->fd, rd->mem + off, (size_t)nblks*BLOCK_SIZE - off, off);
+        if (n <= 0) {
+            fprintf(stderr, "read error on %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        off += n;
+    }
+    pthread_mutex_init(&rd->lock, NULL);
+
+    dev->private = rd;
+    dev->ops = &ram_ops;
+
+    return dev;
+}
+
 /**
  * Force an image blkdev into failure. After this any
  * further access to that device will return E_UNAVAIL.
@@ -20,5 +20,47 @@
  */
 extern struct blkdev *image_create(char *path);
 
+/**
+ * Create an image block device reading from a specified image
+ * file opened with O_DIRECT, bypassing the host page cache.
+ * Transfers from buffers not aligned to BLKBUF_ALIGN go through
+ * aligned buffers from the block buffer pool.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or read image file
+ */
+extern struct blkdev *image_create_direct(char *path);
+
+/**
+ * Create an image block device that maps a specified image
+ * file into memory. Reads and writes are memory copies, and
+ * flush writes modified pages back to the image file.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or map image file
+ */
+extern struct blkdev *image_create_mmap(char *path);
+
+/** RAM disk options */
+enum {
+    RAM_SAVE = 1,       /* save modified blocks to the image file on flush and close */
+    RAM_HUGEPAGES = 2   /* back the RAM disk with huge pages if possible */
+};
+
+/**
+ * Create a RAM disk block device that keeps all blocks in an
+ * anonymous memory region. If path is not NULL, the device has
+ * the size and content of the image file; otherwise it has
+ * nblks blocks of 0s. With RAM_SAVE, blocks modified since
+ * the last save are written back to the image file on flush
+ * and close; otherwise changes are lost on close.
+ *
+ * @param path the path to the image file to load, or NULL
+ * @param nblks the number of blocks if path is NULL
+ * @param flags RAM_SAVE and RAM_HUGEPAGES, or 0
+ * @return the block device or NULL if cannot allocate or load
+ */
+extern struct blkdev *image_create_ram(char *path, blkno_t nblks, int flags);
+
 
 #endif /* IMAGE_H_ */
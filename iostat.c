@@ -0,0 +1,391 @@
+/*
+ * file:        iostat.c
+ *
+ * description: I/O statistics block device for CS 7600 / CS 5600
+ *              file system, layered over any other block device.
+ *              Counters are updated with relaxed atomic operations
+ *              so that statistics are cheap enough to leave on.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blkdev.h"
+#include "iostat.h"
+
+/** definition of I/O statistics block device */
+struct iostat_dev {
+    struct blkdev *dev;             // underlying block device
+    struct iostat_stats stats;      // statistics
+    blkno_t next[IOSTAT_NOPS];      // block following last request
+};
+
+/**
+ * Current time of monotonic clock.
+ *
+ * @return the time in nanoseconds
+ */
+static inline long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Atomically add to a counter.
+ *
+ * @param p the counter
+ * @param n the amount to add
+ */
+static inline void count(long *p, long n)
+{
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a request and classify it as sequential or random.
+ *
+ * @param sd the statistics device
+ * @param op the operation
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ */
+static void iostat_start(struct iostat_dev *sd, int op, blkno_t first_blk, blkno_t num_blks)
+{
+    struct iostat_op *s = &sd->stats.ops[op];
+    blkno_t last = __atomic_exchange_n(&sd->next[op], first_blk + num_blks,
+                                    __ATOMIC_RELAXED);
+    count(&s->count, 1);
+    count(&s->blocks, num_blks);
+    count(last == first_blk ? &s->seq : &s->random, 1);
+}
+
+/**
+ * Record the latency of a request.
+ *
+ * @param sd the statistics device
+ * @param op the operation
+ * @param ns the latency in nanoseconds
+ */
+static void iostat_latency(struct iostat_dev *sd, int op, long ns)
+{
+    struct iostat_op *s = &sd->stats.ops[op];
+    int b = (ns > 1) ? 63 - __builtin_clzl(ns) : 0;
+    if (b >= IOSTAT_BUCKETS) {
+        b = IOSTAT_BUCKETS - 1;
+    }
+    count(&s->total_ns, ns);
+    count(&s->hist[b], 1);
+}
+
+/**
+ * Total number of blocks in iovec buffers.
+ *
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return the number of blocks
+ */
+static int iov_blocks(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len / BLOCK_SIZE;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t iostat_num_blocks(struct blkdev *dev)
+{
+    struct iostat_dev *sd = dev->private;
+    return sd->dev->ops->num_blocks(sd->dev);
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return result from underlying device
+ */
+static int iostat_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_READ, first_blk, num_blks);
+    long t = now_ns();
+    int val = sd->dev->ops->read(sd->dev, first_blk, num_blks, buf);
+    iostat_latency(sd, IOSTAT_READ, now_ns() - t);
+    return val;
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return result from underlying device
+ */
+static int iostat_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_WRITE, first_blk, num_blks);
+    long t = now_ns();
+    int val = sd->dev->ops->write(sd->dev, first_blk, num_blks, buf);
+    iostat_latency(sd, IOSTAT_WRITE, now_ns() - t);
+    return val;
+}
+
+/**
+ * Read contiguous blocks into several buffers.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to read
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return result from underlying device
+ */
+static int iostat_readv(struct blkdev *dev, blkno_t first_blk,
+                        const struct iovec *iov, int iovcnt)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_READ, first_blk, iov_blocks(iov, iovcnt));
+    long t = now_ns();
+    int val = blkdev_readv(sd->dev, first_blk, iov, iovcnt);
+    iostat_latency(sd, IOSTAT_READ, now_ns() - t);
+    return val;
+}
+
+/**
+ * Write contiguous blocks from several buffers.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to write
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return result from underlying device
+ */
+static int iostat_writev(struct blkdev *dev, blkno_t first_blk,
+                         const struct iovec *iov, int iovcnt)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_WRITE, first_blk, iov_blocks(iov, iovcnt));
+    long t = now_ns();
+    int val = blkdev_writev(sd->dev, first_blk, iov, iovcnt);
+    iostat_latency(sd, IOSTAT_WRITE, now_ns() - t);
+    return val;
+}
+
+/**
+ * Flush the block device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return result from underlying device
+ */
+static int iostat_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_FLUSH, first_blk, num_blks);
+    long t = now_ns();
+    int val = sd->dev->ops->flush(sd->dev, first_blk, num_blks);
+    iostat_latency(sd, IOSTAT_FLUSH, now_ns() - t);
+    return val;
+}
+
+/**
+ * Discard blocks of the block device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return result from underlying device
+ */
+static int iostat_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct iostat_dev *sd = dev->private;
+    iostat_start(sd, IOSTAT_DISCARD, first_blk, num_blks);
+    long t = now_ns();
+    int val = blkdev_discard(sd->dev, first_blk, num_blks);
+    iostat_latency(sd, IOSTAT_DISCARD, now_ns() - t);
+    return val;
+}
+
+/**
+ * Pass a hint to the underlying device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ * @param hint the hint
+ * @return SUCCESS
+ */
+static int iostat_hint(struct blkdev *dev, blkno_t first_blk, int num_blks, int hint)
+{
+    struct iostat_dev *sd = dev->private;
+    blkdev_hint(sd->dev, first_blk, num_blks, hint);
+    return SUCCESS;
+}
+
+/**
+ * Pass a prefetch to the underlying device. Prefetches are
+ * not counted, since the blocks are counted when read.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS
+ */
+static int iostat_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct iostat_dev *sd = dev->private;
+    blkdev_prefetch(sd->dev, first_blk, num_blks);
+    return SUCCESS;
+}
+
+/**
+ * Submit requests to the underlying device without waiting.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return result from underlying device
+ */
+static int iostat_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct iostat_dev *sd = dev->private;
+    for (int i = 0; i < nreqs; i++) {
+        int op = (reqs[i].op == BLKDEV_WRITE) ? IOSTAT_WRITE : IOSTAT_READ;
+        iostat_start(sd, op, reqs[i].first_blk, reqs[i].num_blks);
+    }
+    return sd->dev->ops->submit(sd->dev, reqs, nreqs);
+}
+
+/**
+ * Wait for submitted requests to complete. The wait is recorded
+ * as the latency of each request.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return result from underlying device
+ */
+static int iostat_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct iostat_dev *sd = dev->private;
+    long t = now_ns();
+    int val = sd->dev->ops->complete(sd->dev, reqs, nreqs);
+    long ns = now_ns() - t;
+    for (int i = 0; i < nreqs; i++) {
+        int op = (reqs[i].op == BLKDEV_WRITE) ? IOSTAT_WRITE : IOSTAT_READ;
+        iostat_latency(sd, op, ns);
+    }
+    return val;
+}
+
+/**
+ * Close the block device and the underlying device.
+ *
+ * @param dev the block device
+ */
+static void iostat_close(struct blkdev *dev)
+{
+    struct iostat_dev *sd = dev->private;
+    sd->dev->ops->close(sd->dev);
+    free(sd);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops iostat_ops = {
+    .num_blocks = iostat_num_blocks,
+    .read = iostat_read,
+    .write = iostat_write,
+    .flush = iostat_flush,
+    .close = iostat_close,
+    .readv = iostat_readv,
+    .writev = iostat_writev,
+    .discard = iostat_discard,
+    .hint = iostat_hint,
+    .prefetch = iostat_prefetch
+};
+
+/** Operations on this block device if underlying device is asynchronous */
+static struct blkdev_ops iostat_async_ops = {
+    .num_blocks = iostat_num_blocks,
+    .read = iostat_read,
+    .write = iostat_write,
+    .flush = iostat_flush,
+    .close = iostat_close,
+    .readv = iostat_readv,
+    .writev = iostat_writev,
+    .submit = iostat_submit,
+    .complete = iostat_complete,
+    .discard = iostat_discard,
+    .hint = iostat_hint,
+    .prefetch = iostat_prefetch
+};
+
+/**
+ * Create an I/O statistics block device layered over an
+ * existing block device. Each request is counted and timed
+ * with a monotonic clock, and counters are updated without
+ * locking. Asynchronous requests are counted when submitted,
+ * and their latency is the time spent waiting to complete them.
+ *
+ * @param dev the underlying block device
+ * @return the block device or NULL if cannot be allocated
+ */
+struct blkdev *iostat_create(struct blkdev *dev)
+{
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    struct blkdev *sdev = malloc(sizeof(*sdev));
+    struct iostat_dev *sd = calloc(1, sizeof(*sd));
+    if (sdev == NULL || sd == NULL) {
+        free(sdev);
+        free(sd);
+        return NULL;
+    }
+    sd->dev = dev;
+
+    sdev->private = sd;
+    sdev->ops = (dev->ops->submit != NULL && dev->ops->complete != NULL)
+              ? &iostat_async_ops : &iostat_ops;
+
+    return sdev;
+}
+
+/**
+ * Get the statistics of an I/O statistics block device.
+ *
+ * @param dev the I/O statistics block device
+ * @param stats the statistics returned
+ * @param reset 1 to reset statistics to 0 as they are read
+ */
+void iostat_get_stats(struct blkdev *dev, struct iostat_stats *stats, int reset)
+{
+    struct iostat_dev *sd = dev->private;
+
+    // counters are all longs: read each one atomically
+    long *src = (long*)&sd->stats, *dst = (long*)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(long); i++) {
+        dst[i] = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED)
+                       : __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * file:        iostat.h
+ *
+ * description: I/O statistics block device for CS 7600 / CS 5600
+ *              file system, layered over any other block device
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef IOSTAT_H_
+#define IOSTAT_H_
+
+#include "blkdev.h"
+
+/** operations with statistics */
+enum {IOSTAT_READ = 0, IOSTAT_WRITE = 1, IOSTAT_FLUSH = 2, IOSTAT_DISCARD = 3,
+      IOSTAT_NOPS = 4};
+
+/** number of latency buckets: bucket i counts [2^i, 2^(i+1)) ns */
+enum {IOSTAT_BUCKETS = 40};
+
+/** statistics for one operation */
+struct iostat_op {
+    long count;         /* number of requests */
+    long blocks;        /* number of blocks transferred */
+    long seq;           /* requests starting where the last one ended */
+    long random;        /* other requests */
+    long total_ns;      /* total latency in nanoseconds */
+    long hist[IOSTAT_BUCKETS];  /* log2 latency histogram */
+};
+
+/** statistics for all operations */
+struct iostat_stats {
+    struct iostat_op ops[IOSTAT_NOPS];
+};
+
+/**
+ * Create an I/O statistics block device layered over an
+ * existing block device. Each request is counted and timed
+ * with a monotonic clock, and counters are updated without
+ * locking. Asynchronous requests are counted when submitted,
+ * and their latency is the time spent waiting to complete them.
+ *
+ * @param dev the underlying block device
+ * @return the block device or NULL if cannot be allocated
+ */
+extern struct blkdev *iostat_create(struct blkdev *dev);
+
+/**
+ * Get the statistics of an I/O statistics block device.
+ *
+ * @param dev the I/O statistics block device
+ * @param stats the statistics returned
+ * @param reset 1 to reset statistics to 0 as they are read
+ */
+extern void iostat_get_stats(struct blkdev *dev, struct iostat_stats *stats, int reset);
+
+#endif /* IOSTAT_H_ */
@@ -0,0 +1,504 @@
+/*
+ * file:        mirror.c
+ *
+ * description: mirrored (RAID-1) block device for CS 7600 /
+ *              CS 5600 file system. Every block is written to
+ *              all member devices, and reads are balanced
+ *              across them.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "blkdev.h"
+#include "mirror.h"
+
+/** reads of at least this many blocks are split across members */
+enum {MIRROR_SPLIT_BLKS = 64};
+
+/** member of a mirrored device */
+struct mirror_member {
+    struct blkdev *dev;         // member device
+    int   failed;               // 1 if member failed and is not used; never cleared
+    int   pending;              // number of reads in progress
+    blkno_t head;               // block following last read
+};
+
+/** definition of mirrored block device */
+struct mirror_dev {
+    int   ndevs;                // number of member devices
+    struct mirror_member *members;  // member devices
+    blkno_t nblks;              // number of blocks
+    pthread_mutex_t lock;       // protects member state
+};
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t mirror_num_blocks(struct blkdev *dev)
+{
+    struct mirror_dev *md = dev->private;
+    return md->nblks;
+}
+
+/**
+ * Choose the member to read blocks from: the member with the
+ * fewest reads in progress, or on a tie the one whose last
+ * read ended nearest the first block. Must hold lock.
+ *
+ * @param md the mirrored device
+ * @param first_blk the first block to read
+ * @return the member index, or -1 if all members failed
+ */
+static int mirror_choose(struct mirror_dev *md, blkno_t first_blk)
+{
+    int best = -1;
+    blkno_t best_dist = 0;
+    for (int d = 0; d < md->ndevs; d++) {
+        struct mirror_member *m = &md->members[d];
+        if (m->failed) {
+            continue;
+        }
+        blkno_t dist = (first_blk > m->head) ? first_blk - m->head : m->head - first_blk;
+        if (best < 0 || m->pending < md->members[best].pending
+            || (m->pending == md->members[best].pending && dist < best_dist)) {
+            best = d;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+/**
+ * Start a read on the member chosen for it.
+ *
+ * @param md the mirrored device
+ * @param first_blk the first block to read
+ * @param num_blks the number of blocks
+ * @return the member index, or -1 if all members failed
+ */
+static int mirror_start(struct mirror_dev *md, blkno_t first_blk, int num_blks)
+{
+    pthread_mutex_lock(&md->lock);
+    int d = mirror_choose(md, first_blk);
+    if (d >= 0) {
+        md->members[d].pending++;
+        md->members[d].head = first_blk + num_blks;
+    }
+    pthread_mutex_unlock(&md->lock);
+    return d;
+}
+
+/**
+ * Determine whether a member is still used.
+ *
+ * @param md the mirrored device
+ * @param d the member index
+ * @return 1 (true) if member has not failed, 0 (false) otherwise
+ */
+static int mirror_working(struct mirror_dev *md, int d)
+{
+    pthread_mutex_lock(&md->lock);
+    int working = !md->members[d].failed;
+    pthread_mutex_unlock(&md->lock);
+    return working;
+}
+
+/**
+ * Record the result of a request on a member. A member that
+ * returns an error other than E_BADADDR has failed.
+ *
+ * @param md the mirrored device
+ * @param d the member index
+ * @param read 1 if request was a read started by mirror_start()
+ * @param val the result of the request
+ */
+static void mirror_finish(struct mirror_dev *md, int d, int read, int val)
+{
+    pthread_mutex_lock(&md->lock);
+    if (read) {
+        md->members[d].pending--;
+    }
+    if (val != SUCCESS && val != E_BADADDR && !md->members[d].failed) {
+        md->members[d].failed = 1;
+        fprintf(stderr, "mirror member %d failed, continuing without it\n", d);
+    }
+    pthread_mutex_unlock(&md->lock);
+}
+
+/**
+ * Read blocks from one member, trying another member if the
+ * chosen one fails.
+ *
+ * @param md the mirrored device
+ * @param first_blk starting block offset
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @param num_blks number of blocks in the buffers
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or E_UNAVAIL if all members failed
+ */
+static int mirror_read_one(struct mirror_dev *md, blkno_t first_blk,
+                           const struct iovec *iov, int iovcnt, int num_blks)
+{
+    for (;;) {
+        int d = mirror_start(md, first_blk, num_blks);
+        if (d < 0) {
+            return E_UNAVAIL;
+        }
+        int val = blkdev_readv(md->members[d].dev, first_blk, iov, iovcnt);
+        mirror_finish(md, d, 1, val);
+        if (val == SUCCESS || val == E_BADADDR) {
+            return val;
+        }
+    }
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ * A large read is split into one part for each working member,
+ * and all parts are submitted before waiting for any of them.
+ * A part whose member fails is read again from another member.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or E_UNAVAIL if all members failed
+ */
+static int mirror_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct mirror_dev *md = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > md->nblks) {
+        return E_BADADDR;
+    }
+
+    int nparts = 0;
+    if (num_blks >= MIRROR_SPLIT_BLKS) {
+        pthread_mutex_lock(&md->lock);
+        for (int d = 0; d < md->ndevs; d++) {
+            nparts += !md->members[d].failed;
+        }
+        pthread_mutex_unlock(&md->lock);
+    }
+    if (nparts < 2) {
+        struct iovec iov = {.iov_base = buf, .iov_len = (size_t)num_blks * BLOCK_SIZE};
+        return mirror_read_one(md, first_blk, &iov, 1, num_blks);
+    }
+
+    // one part for each member, each started on its own member
+    struct blkdev_req reqs[nparts];
+    int devs[nparts];
+    memset(reqs, 0, sizeof(reqs));
+    for (int i = 0, done = 0; i < nparts; i++) {
+        int n = (num_blks - done) / (nparts - i);
+        reqs[i].op = BLKDEV_READ;
+        reqs[i].first_blk = first_blk + done;
+        reqs[i].num_blks = n;
+        reqs[i].buf = (char*)buf + (size_t)done * BLOCK_SIZE;
+        devs[i] = mirror_start(md, reqs[i].first_blk, n);
+        if (devs[i] < 0 || blkdev_submit(md->members[devs[i]].dev, &reqs[i], 1) != SUCCESS) {
+            reqs[i].status = E_UNAVAIL;
+            reqs[i].done = 1;
+        }
+        done += n;
+    }
+
+    int val = SUCCESS;
+    for (int i = 0; i < nparts; i++) {
+        if (!reqs[i].done) {
+            blkdev_complete(md->members[devs[i]].dev, &reqs[i], 1);
+        }
+        if (devs[i] >= 0) {
+            mirror_finish(md, devs[i], 1, reqs[i].status);
+        }
+    }
+    for (int i = 0; i < nparts && val == SUCCESS; i++) {
+        if (reqs[i].status != SUCCESS) {
+            struct iovec iov = {
+                .iov_base = reqs[i].buf,
+                .iov_len = (size_t)reqs[i].num_blks * BLOCK_SIZE
+            };
+            val = mirror_read_one(md, reqs[i].first_blk, &iov, 1, reqs[i].num_blks);
+        }
+    }
+    return val;
+}
+
+/**
+ * Read contiguous blocks into several buffers from one member.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or E_UNAVAIL if all members failed
+ */
+static int mirror_readv(struct blkdev *dev, blkno_t first_blk,
+                        const struct iovec *iov, int iovcnt)
+{
+    struct mirror_dev *md = dev->private;
+    int num_blks = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        num_blks += iov[i].iov_len / BLOCK_SIZE;
+    }
+    if (first_blk < 0 || first_blk + num_blks > md->nblks) {
+        return E_BADADDR;
+    }
+    return mirror_read_one(md, first_blk, iov, iovcnt, num_blks);
+}
+
+/**
+ * Write blocks to all working members. A request is submitted
+ * to every member before waiting for any of them. A member
+ * that fails the write is no longer used.
+ *
+ * @param md the mirrored device
+ * @param req the request to send to each member
+ * @return SUCCESS if written to any member, E_BADADDR if range
+ *   invalid, or E_UNAVAIL if all members failed
+ */
+static int mirror_write_all(struct mirror_dev *md, struct blkdev_req *req)
+{
+    if (req->first_blk < 0 || req->num_blks < 0 || req->first_blk + req->num_blks > md->nblks) {
+        return E_BADADDR;
+    }
+
+    struct blkdev_req reqs[md->ndevs];
+    for (int d = 0; d < md->ndevs; d++) {
+        reqs[d] = *req;
+        reqs[d].done = 1;
+        reqs[d].status = E_UNAVAIL;
+        if (mirror_working(md, d)) {
+            reqs[d].done = 0;
+            if (blkdev_submit(md->members[d].dev, &reqs[d], 1) != SUCCESS) {
+                reqs[d].done = 1;
+                mirror_finish(md, d, 0, E_UNAVAIL);
+            }
+        }
+    }
+
+    int written = 0;
+    for (int d = 0; d < md->ndevs; d++) {
+        if (!reqs[d].done) {
+            blkdev_complete(md->members[d].dev, &reqs[d], 1);
+            mirror_finish(md, d, 0, reqs[d].status);
+            written += (reqs[d].status == SUCCESS);
+        }
+    }
+    return (written > 0) ? SUCCESS : E_UNAVAIL;
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if written to any member, E_BADADDR if range
+ *   invalid, or E_UNAVAIL if all members failed
+ */
+static int mirror_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct blkdev_req req = {
+        .op = BLKDEV_WRITE, .first_blk = first_blk, .num_blks = num_blks, .buf = buf
+    };
+    return mirror_write_all(dev->private, &req);
+}
+
+/**
+ * Write contiguous blocks from several buffers.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if written to any member, E_BADADDR if range
+ *   invalid, or E_UNAVAIL if all members failed
+ */
+static int mirror_writev(struct blkdev *dev, blkno_t first_blk,
+                         const struct iovec *iov, int iovcnt)
+{
+    struct blkdev_req req = {
+        .op = BLKDEV_WRITE, .first_blk = first_blk, .iov = iov, .iovcnt = iovcnt
+    };
+    for (int i = 0; i < iovcnt; i++) {
+        req.num_blks += iov[i].iov_len / BLOCK_SIZE;
+    }
+    return mirror_write_all(dev->private, &req);
+}
+
+/**
+ * Flush all working members. A member that fails the flush is
+ * no longer used.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if any member was flushed, or E_UNAVAIL
+ */
+static int mirror_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct mirror_dev *md = dev->private;
+    int flushed = 0;
+    for (int d = 0; d < md->ndevs; d++) {
+        if (mirror_working(md, d)) {
+            int val = md->members[d].dev->ops->flush(md->members[d].dev, first_blk, num_blks);
+            mirror_finish(md, d, 0, val);
+            flushed += (val == SUCCESS);
+        }
+    }
+    return (flushed > 0) ? SUCCESS : E_UNAVAIL;
+}
+
+/**
+ * Discard blocks on all working members.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, or first error from a member
+ */
+static int mirror_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct mirror_dev *md = dev->private;
+    int val = SUCCESS;
+    for (int d = 0; d < md->ndevs; d++) {
+        if (mirror_working(md, d)) {
+            int v = blkdev_discard(md->members[d].dev, first_blk, num_blks);
+            if (val == SUCCESS) {
+                val = v;
+            }
+        }
+    }
+    return val;
+}
+
+/**
+ * Pass a hint to all members.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ * @param hint the hint
+ * @return SUCCESS
+ */
+static int mirror_hint(struct blkdev *dev, blkno_t first_blk, int num_blks, int hint)
+{
+    struct mirror_dev *md = dev->private;
+    for (int d = 0; d < md->ndevs; d++) {
+        blkdev_hint(md->members[d].dev, first_blk, num_blks, hint);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Prefetch blocks on the member a read of them would use now.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS
+ */
+static int mirror_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct mirror_dev *md = dev->private;
+    pthread_mutex_lock(&md->lock);
+    int d = mirror_choose(md, first_blk);
+    pthread_mutex_unlock(&md->lock);
+    if (d >= 0) {
+        blkdev_prefetch(md->members[d].dev, first_blk, num_blks);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close the block device and its members.
+ *
+ * @param dev the block device
+ */
+static void mirror_close(struct blkdev *dev)
+{
+    struct mirror_dev *md = dev->private;
+    for (int d = 0; d < md->ndevs; d++) {
+        md->members[d].dev->ops->close(md->members[d].dev);
+    }
+    pthread_mutex_destroy(&md->lock);
+    free(md->members);
+    free(md);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops mirror_ops = {
+    .num_blocks = mirror_num_blocks,
+    .read = mirror_read,
+    .write = mirror_write,
+    .flush = mirror_flush,
+    .close = mirror_close,
+    .readv = mirror_readv,
+    .writev = mirror_writev,
+    .discard = mirror_discard,
+    .hint = mirror_hint,
+    .prefetch = mirror_prefetch
+};
+
+/**
+ * Create a mirrored block device over several member devices,
+ * each holding a copy of every block. Writes go to all members
+ * in parallel. Each read goes to the member with the fewest
+ * reads in progress, or on a tie the member whose last read
+ * ended nearest the block. Large reads are split across the
+ * members. A member that fails is no longer used, and the
+ * device works while any member remains. The device has as
+ * many blocks as the smallest member. Closing the device
+ * closes the members.
+ *
+ * @param devs the member devices
+ * @param ndevs the number of member devices
+ * @return the block device or NULL if cannot be created
+ */
+struct blkdev *mirror_create(struct blkdev *devs[], int ndevs)
+{
+    if (ndevs <= 0) {
+        return NULL;
+    }
+
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct mirror_dev *md = malloc(sizeof(*md));
+    struct mirror_member *members = calloc(ndevs, sizeof(struct mirror_member));
+    if (dev == NULL || md == NULL || members == NULL) {
+        free(dev);
+        free(md);
+        free(members);
+        return NULL;
+    }
+
+    // every member holds a copy of the blocks of the smallest
+    md->nblks = devs[0]->ops->num_blocks(devs[0]);
+    for (int d = 0; d < ndevs; d++) {
+        members[d].dev = devs[d];
+        if (devs[d]->ops->num_blocks(devs[d]) < md->nblks) {
+            md->nblks = devs[d]->ops->num_blocks(devs[d]);
+        }
+    }
+    md->ndevs = ndevs;
+    md->members = members;
+    pthread_mutex_init(&md->lock, NULL);
+
+    dev->private = md;
+    dev->ops = &mirror_ops;
+
+    return dev;
+}
@@ -0,0 +1,32 @@
+/*
+ * file:        mirror.h
+ *
+ * description: mirrored (RAID-1) block device for CS 7600 /
+ *              CS 5600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef MIRROR_H_
+#define MIRROR_H_
+
+#include "blkdev.h"
+
+/**
+ * Create a mirrored block device over several member devices,
+ * each holding a copy of every block. Writes go to all members
+ * in parallel. Each read goes to the member with the fewest
+ * reads in progress, or on a tie the member whose last read
+ * ended nearest the block. Large reads are split across the
+ * members. A member that fails is no longer used, and the
+ * device works while any member remains. The device has as
+ * many blocks as the smallest member. Closing the device
+ * closes the members.
+ *
+ * @param devs the member devices
+ * @param ndevs the number of member devices
+ * @return the block device or NULL if cannot be created
+ */
+extern struct blkdev *mirror_create(struct blkdev *devs[], int ndevs);
+
+#endif /* MIRROR_H_ */
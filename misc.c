@@ -23,11 +23,21 @@
 #include <limits.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <fuse.h>
 
 #include "split.h"
 #include "max.h"
 #include "image.h"
+#include "cache.h"
+#include "wqueue.h"
+#include "stripe.h"
+#include "mirror.h"
+#include "iostat.h"
+#include "throttle.h"
+#include "cimage.h"
+#include "overlay.h"
+#include "mkfs.h"
 #include "fsx600.h"		/* only for certain constants */
 
 // should be defined in stdio.h but is not on macos
@@ -43,15 +53,66 @@ extern struct fuse_operations fs_ops;
 /**  disk block device */
 struct blkdev *disk;
 
+/** I/O statistics block device below the write queue and cache */
+static struct blkdev *iostat_disk;
+
+/** caching block device, or NULL if no cache */
+static struct blkdev *cache_disk;
+
 struct data {
     char *image_name;
     int   cmd_mode;
+    int   mmap;
+    int   direct;
+    int   cache_blks;
+    int   write_back;
+    int   cache_2q;
+    int   wqueue_blks;
+    int   chunk_blks;
+    int   mirror;
+    int   ram;
+    int   save;
+    int   hugepages;
+    int   latency_us;
+    int   bandwidth_kb;
+    int   seek_us;
+    char *compress_name;
+    char *base_name;
+    char *merge_name;
+    long long mkfs_blks;
+    int   groups;
 } _data;
 
+/** maximum number of images striped or mirrored together */
+enum {MAX_IMAGES = 16};
+
+/** default number of blocks per stripe chunk */
+enum {DEFAULT_CHUNK_BLKS = 16};
+
 static void help(){
     printf("Arguments:\n");
     printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
     printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+    printf(" -image <a.img,b.img,...> : Stripe the filesystem across several image files\n");
+    printf(" -chunk <nblks> : Number of blocks per stripe chunk (default %d)\n", DEFAULT_CHUNK_BLKS);
+    printf(" -mirror : Mirror the filesystem on each of several image files instead of striping\n");
+    printf(" -mmap : Map the image file into memory instead of reading and writing it\n");
+    printf(" -direct : Open the image file with O_DIRECT, bypassing the host page cache\n");
+    printf(" -ram : Load the image file into memory; changes are lost unless -save is given\n");
+    printf(" -save : Save changes to a -ram image file on flush and exit\n");
+    printf(" -hugepages : Back a -ram image with huge pages if possible\n");
+    printf(" -base <base.img> : Read unwritten blocks from base.img; -image is the delta file\n");
+    printf(" -merge <out.img> : Write a flat copy of the image, with any delta, to out.img and exit\n");
+    printf(" -compress <out.img> : Write a compressed copy of the image to out.img and exit\n");
+    printf(" -mkfs <nblks> : Create an empty file system of nblks blocks, creating the image file if needed\n");
+    printf(" -groups : Divide a file system created by -mkfs into block groups\n");
+    printf(" -latency <us> : Delay each image request by us microseconds\n");
+    printf(" -bandwidth <KiB/s> : Limit image transfers to KiB/s\n");
+    printf(" -seek <us> : Delay image requests up to us microseconds by distance from last request\n");
+    printf(" -cache <nblks> : Cache up to nblks blocks of the image in memory\n");
+    printf(" -writeback : Write cached blocks back to the image only when evicted or flushed\n");
+    printf(" -2q : Use scan-resistant 2Q cache replacement instead of LRU\n");
+    printf(" -wqueue <nblks> : Queue up to nblks written blocks and write them in sorted, merged runs\n");
 }
 
 /*
@@ -65,6 +126,25 @@ static void help(){
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
     {"-cmdline", offsetof(struct data, cmd_mode), 1},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-direct", offsetof(struct data, direct), 1},
+    {"-ram", offsetof(struct data, ram), 1},
+    {"-save", offsetof(struct data, save), 1},
+    {"-hugepages", offsetof(struct data, hugepages), 1},
+    {"-base %s", offsetof(struct data, base_name), 0},
+    {"-merge %s", offsetof(struct data, merge_name), 0},
+    {"-compress %s", offsetof(struct data, compress_name), 0},
+    {"-mkfs %lld", offsetof(struct data, mkfs_blks), 0},
+    {"-groups", offsetof(struct data, groups), 1},
+    {"-latency %d", offsetof(struct data, latency_us), 0},
+    {"-bandwidth %d", offsetof(struct data, bandwidth_kb), 0},
+    {"-seek %d", offsetof(struct data, seek_us), 0},
+    {"-cache %d", offsetof(struct data, cache_blks), 0},
+    {"-writeback", offsetof(struct data, write_back), 1},
+    {"-2q", offsetof(struct data, cache_2q), 1},
+    {"-wqueue %d", offsetof(struct data, wqueue_blks), 0},
+    {"-chunk %d", offsetof(struct data, chunk_blks), 0},
+    {"-mirror", offsetof(struct data, mirror), 1},
     FUSE_OPT_END
 };
 
@@ -807,15 +887,62 @@ static int do_statfs(char *argv[])
     int retval = fs_ops.statfs("/", &st);
     if (retval == 0) {
     	printf("block size: %lu\n", st.f_bsize);
-    	printf("no. blocks: %u\n", st.f_blocks);
-    	printf("no. free blocks: %u\n", st.f_bfree);
-    	printf("no. inodes: %u\n", st.f_files);
-    	printf("no. free inodes: %u\n",  st.f_ffree);
+    	printf("no. blocks: %lu\n", st.f_blocks);
+    	printf("no. free blocks: %lu\n", st.f_bfree);
+    	printf("no. inodes: %lu\n", st.f_files);
+    	printf("no. free inodes: %lu\n", st.f_ffree);
     	printf("max name length: %lu\n", st.f_namemax);
     }
     return retval;
 }
 
+/**
+ * Print statistics of one block device operation.
+ *
+ * @param name the operation name
+ * @param s the operation statistics
+ */
+static void print_iostat_op(const char *name, const struct iostat_op *s)
+{
+    printf("%-7s %8ld %10ld %8ld %8ld %10.1f\n", name, s->count, s->blocks,
+           s->seq, s->random, s->count ? s->total_ns / 1000.0 / s->count : 0.0);
+    for (int b = 0; b < IOSTAT_BUCKETS; b++) {
+        if (s->hist[b] != 0) {
+            printf("    < %10.3f us: %ld\n", (2L << b) / 1000.0, s->hist[b]);
+        }
+    }
+}
+
+/**
+ * Print and reset I/O statistics of the image volume, measured
+ * below the write queue and cache, and print the cache hit and
+ * miss counters if there is a cache.
+ *
+ * @param argv unused
+ * @return 0
+ */
+static int do_iostat(char *argv[])
+{
+    struct iostat_stats st;
+    iostat_get_stats(iostat_disk, &st, 1);
+    printf("image I/O (below cache and write queue):\n");
+    printf("%-7s %8s %10s %8s %8s %10s\n",
+           "op", "count", "blocks", "seq", "random", "avg us");
+    print_iostat_op("read", &st.ops[IOSTAT_READ]);
+    print_iostat_op("write", &st.ops[IOSTAT_WRITE]);
+    print_iostat_op("flush", &st.ops[IOSTAT_FLUSH]);
+    print_iostat_op("discard", &st.ops[IOSTAT_DISCARD]);
+
+    if (cache_disk != NULL) {
+        struct cache_stats cs;
+        cache_get_stats(cache_disk, &cs);
+        long total = cs.hits + cs.misses;
+        printf("cache (since start): %ld hits %ld misses (%.1f%% hits) %ld writebacks\n",
+               cs.hits, cs.misses, total ? 100.0 * cs.hits / total : 0.0, cs.writebacks);
+    }
+    return 0;
+}
+
 /**
  * Print files statistics
  *
@@ -948,6 +1075,7 @@ static struct {
     {"chmod", 2, do_chmod, "chmod <mode> <file> - change permissions"},
     {"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
     {"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
+    {"iostat", 0, do_iostat, "iostat - print and reset image I/O statistics (below cache and write queue), and cache hits"},
     {"link", 2, do_link, "link <name> <linkname> - create a link to a file"},
     {"ls", 0, do_ls0, "ls - list files in current directory"},
     {"ls", 1, do_ls1, "ls <dir> - list specified directory"},
@@ -1105,6 +1233,53 @@ static void fixup(int argc, char *argv[]) {
 	}
 }
 
+/**
+ * Open an image file as a block device, using the access
+ * method and simulated media speed selected by the command
+ * line options. Compressed images are detected by content.
+ *
+ * @param file the image file name
+ * @return the block device, or NULL if cannot be opened
+ */
+static struct blkdev *open_image(char *file)
+{
+    if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
+        fprintf(stderr, "bad image file (must end in .img): %s\n", file);
+        return NULL;
+    }
+
+    struct blkdev *dev;
+    if (cimage_detect(file)) {
+        dev = cimage_create(file);
+    } else if (_data.ram) {
+        int flags = (_data.save ? RAM_SAVE : 0) | (_data.hugepages ? RAM_HUGEPAGES : 0);
+        dev = image_create_ram(file, 0, flags);
+    } else if (_data.mmap) {
+        dev = image_create_mmap(file);
+    } else if (_data.direct) {
+        dev = image_create_direct(file);
+    } else {
+        dev = image_create(file);
+    }
+    if (dev == NULL) {
+        fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    // simulate slow media
+    if (_data.latency_us > 0 || _data.bandwidth_kb > 0 || _data.seek_us > 0) {
+        struct throttle_params params = {
+            .latency_us = _data.latency_us,
+            .bandwidth_kb = _data.bandwidth_kb,
+            .seek_us = _data.seek_us
+        };
+        if ((dev = throttle_create(dev, &params)) == NULL) {
+            fprintf(stderr, "cannot throttle image file '%s'\n", file);
+        }
+    }
+    return dev;
+}
+
 int main(int argc, char **argv)
 {
 	fixup(argc, argv);
@@ -1123,23 +1298,121 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    char *file = _data.image_name;
-    if (strcmp(file+strlen(file)-4, ".img") != 0) {
-        fprintf(stderr, "bad image file (must end in .img): %s\n", file);
+    // open each image; several images are striped or mirrored together
+    char *files[MAX_IMAGES+1];
+    char *base_name = (_data.base_name != NULL) ? _data.base_name : _data.image_name;
+    int nfiles = split(base_name, files, MAX_IMAGES+1, ",");
+    if (nfiles == 0 || nfiles > MAX_IMAGES) {
+        fprintf(stderr, "must provide 1 to %d image files\n", MAX_IMAGES);
         help();
         exit(1);
     }
+    // create a single image file to format
+    if (_data.mkfs_blks > 0 && nfiles == 1 && access(files[0], F_OK) != 0) {
+        int fd = open(files[0], O_RDWR | O_CREAT, 0666);
+        if (fd < 0 || ftruncate(fd, (off_t)_data.mkfs_blks * BLOCK_SIZE) < 0) {
+            fprintf(stderr, "cannot create image file '%s': %s\n", files[0], strerror(errno));
+            exit(1);
+        }
+        close(fd);
+    }
 
-    if ((disk = image_create(file)) == NULL) {
-        fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
-        help();
+    struct blkdev *devs[MAX_IMAGES];
+    for (int i = 0; i < nfiles; i++) {
+        if ((devs[i] = open_image(files[i])) == NULL) {
+            help();
+            exit(1);
+        }
+    }
+
+    if (nfiles == 1) {
+        disk = devs[0];
+    } else if (_data.mirror) {
+        if ((disk = mirror_create(devs, nfiles)) == NULL) {
+            fprintf(stderr, "cannot mirror %d image files\n", nfiles);
+            exit(1);
+        }
+    } else {
+        int chunk = (_data.chunk_blks > 0) ? _data.chunk_blks : DEFAULT_CHUNK_BLKS;
+        if ((disk = stripe_create(devs, nfiles, chunk)) == NULL) {
+            fprintf(stderr, "cannot stripe %d image files\n", nfiles);
+            exit(1);
+        }
+    }
+    free_split_tokens(files, nfiles);
+
+    // image is a delta over the base images
+    if (_data.base_name != NULL) {
+        if ((disk = overlay_create(disk, _data.image_name)) == NULL) {
+            fprintf(stderr, "cannot open delta '%s'\n", _data.image_name);
+            exit(1);
+        }
+    }
+
+    // create empty file system
+    if (_data.mkfs_blks > 0) {
+        int val = mkfs(disk, _data.mkfs_blks, _data.groups ? MKFS_GROUPS : 0);
+        if (val != SUCCESS) {
+            fprintf(stderr, "cannot create %lld block file system\n", _data.mkfs_blks);
+            exit(1);
+        }
+    }
+
+    // write flat copy of image
+    if (_data.merge_name != NULL) {
+        int val = overlay_merge(disk, _data.merge_name);
+        disk->ops->close(disk);
+        if (val != SUCCESS) {
+            fprintf(stderr, "cannot merge image to '%s'\n", _data.merge_name);
+            exit(1);
+        }
+        return 0;
+    }
+
+    // write compressed copy of image
+    if (_data.compress_name != NULL) {
+        int val = cimage_convert(disk, _data.compress_name, CIMAGE_CLUSTER_BLKS);
+        disk->ops->close(disk);
+        if (val != SUCCESS) {
+            fprintf(stderr, "cannot compress image to '%s'\n", _data.compress_name);
+            exit(1);
+        }
+        return 0;
+    }
+
+    // always collect I/O statistics: they are cheap. Measure the
+    // volume below the write queue and cache, so only requests that
+    // reach the image files are counted.
+    if ((iostat_disk = iostat_create(disk)) == NULL) {
+        fprintf(stderr, "cannot create I/O statistics\n");
         exit(1);
     }
+    disk = iostat_disk;
+
+    if (_data.wqueue_blks > 0) {
+        if ((disk = wqueue_create(disk, _data.wqueue_blks)) == NULL) {
+            fprintf(stderr, "cannot create %d block write queue\n", _data.wqueue_blks);
+            exit(1);
+        }
+    }
+
+    if (_data.cache_blks > 0) {
+        int policy = _data.write_back ? CACHE_WRITE_BACK : CACHE_WRITE_THROUGH;
+        if (_data.cache_2q) {
+            policy |= CACHE_2Q;
+        }
+        if ((cache_disk = cache_create(disk, _data.cache_blks, policy)) == NULL) {
+            fprintf(stderr, "cannot create %d block cache\n", _data.cache_blks);
+            exit(1);
+        }
+        disk = cache_disk;
+    }
 
     if (_data.cmd_mode) {  /* process interactive commands */
         fs_ops.init(NULL);
         _blksiz(FS_BLOCK_SIZE);
         cmdloop();
+        fs_ops.destroy(NULL);
         return 0;
     }
 
@@ -0,0 +1,249 @@
+/*
+ * file:        mkfs.c
+ *
+ * description: create an empty CS 5600 / 7600 file system on a
+ *              block device
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fsx600.h"
+#include "mkfs.h"
+#include "bitmap.h"
+#include "blkdev.h"
+
+/** number of blocks of 0s written at a time */
+enum {ZERO_BLKS = 64};
+
+/**
+ * Write blocks of 0s.
+ *
+ * @param dev the block device
+ * @param first the first block number
+ * @param n the number of blocks
+ * @return SUCCESS or block device error
+ */
+static int write_zeros(struct blkdev *dev, blkno_t first, blkno_t n)
+{
+    static char zeros[ZERO_BLKS * FS_BLOCK_SIZE];
+    while (n > 0) {
+        int len = (n < ZERO_BLKS) ? n : ZERO_BLKS;
+        int val = dev->ops->write(dev, first, len, zeros);
+        if (val != SUCCESS) {
+            return val;
+        }
+        first += len;
+        n -= len;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write the root directory: its inode in the first inode block,
+ * and its block with the "." and ".." entries.
+ *
+ * @param dev the block device
+ * @param inode_blk the block number of the first inode block
+ * @param dir_blk the block number of the directory block
+ * @return SUCCESS or block device error
+ */
+static int write_root(struct blkdev *dev, blkno_t inode_blk, blkno_t dir_blk)
+{
+    struct fs_inode inodes[INODES_PER_BLK];
+    memset(inodes, 0, sizeof(inodes));
+    struct fs_inode *root = &inodes[1];
+    root->uid = getuid();
+    root->gid = getgid();
+    root->mode = S_IFDIR | 0777;
+    root->ctime = root->mtime = time(NULL);  // OK thorough 2100
+    root->size = 2 * sizeof(struct fs_dirent);
+    root->nlink = 2;
+    root->direct[0] = dir_blk;
+
+    struct fs_dirent de[DIRENTS_PER_BLK];
+    memset(de, 0, sizeof(de));
+    de[0] = (struct fs_dirent){.valid = 1, .isDir = 1, .inode = 1, .name = "."};
+    de[1] = (struct fs_dirent){.valid = 1, .isDir = 1, .inode = 1, .name = ".."};
+
+    int val = dev->ops->write(dev, inode_blk, 1, inodes);
+    if (val == SUCCESS) {
+        val = dev->ops->write(dev, dir_blk, 1, de);
+    }
+    return val;
+}
+
+/**
+ * Create an empty file system with only a root directory on a
+ * block device. Without MKFS_GROUPS, the inode map, block map
+ * and inode blocks follow the superblock. With MKFS_GROUPS, the
+ * volume is divided into groups of BITS_PER_BLK blocks, each
+ * with its own maps and inode blocks, located by a table of
+ * group descriptors after the superblock. A last group too small
+ * for its metadata is left out.
+ *
+ * @param dev the block device
+ * @param nblks the number of blocks to use, or 0 for the whole
+ *   device; at most 2^32 - 1
+ * @param flags 0 or MKFS_GROUPS
+ * @return SUCCESS if successful, E_SIZE if the device is too small
+ *   or, with MKFS_GROUPS, too large for the group descriptors to fit
+ *   in group 0, E_UNAVAIL if cannot allocate memory, or block device
+ *   error
+ */
+int mkfs(struct blkdev *dev, blkno_t nblks, int flags)
+{
+    // block pointers are 32 bits
+    if (nblks <= 0 || nblks > dev->ops->num_blocks(dev)) {
+        nblks = dev->ops->num_blocks(dev);
+    }
+    if (nblks > UINT32_MAX) {
+        nblks = UINT32_MAX;
+    }
+
+    struct fs_super sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.root_inode = 1;
+
+    // size the groups; without block groups there is one group
+    int groups = (flags & MKFS_GROUPS) != 0;
+    blkno_t bpg = groups ? BITS_PER_BLK : nblks;
+    blkno_t ngroups = (nblks + bpg - 1) / bpg;
+    blkno_t ipg = bpg / MKFS_BLKS_PER_INODE;
+    ipg = (ipg + INODES_PER_BLK - 1) / INODES_PER_BLK * INODES_PER_BLK;
+    if (ipg < INODES_PER_BLK) {
+        ipg = INODES_PER_BLK;
+    }
+    blkno_t itb = ipg / INODES_PER_BLK;
+    blkno_t gdt = groups ? (ngroups + GROUP_DESCS_PER_BLK - 1) / GROUP_DESCS_PER_BLK : 0;
+    blkno_t imap = groups ? 1 : (ipg + BITS_PER_BLK - 1) / BITS_PER_BLK;
+    blkno_t bmap = groups ? 1 : (nblks + BITS_PER_BLK - 1) / BITS_PER_BLK;
+
+    // group 0 must hold the superblock, descriptors, its own
+    // metadata and the root directory block
+    if (groups && 1 + gdt + imap + bmap + itb + 1 > bpg) {
+        return E_SIZE;
+    }
+
+    // the last group must hold its metadata and a data block
+    blkno_t last = nblks - (ngroups - 1) * bpg;
+    blkno_t overhead = imap + bmap + itb + ((ngroups == 1) ? 1 + gdt + 1 : 0);
+    if (last <= overhead) {
+        if (ngroups == 1) {
+            return E_SIZE;
+        }
+        ngroups--;
+        nblks = ngroups * bpg;
+    }
+
+    sb.num_blocks = nblks;
+    sb.inode_map_sz = ngroups * imap;
+    sb.block_map_sz = ngroups * bmap;
+    sb.inode_region_sz = ngroups * itb;
+    if (groups) {
+        sb.blocks_per_group = bpg;
+        sb.inodes_per_group = ipg;
+        sb.group_desc_sz = gdt;
+    }
+
+    bitmap_t *block_map = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+    bitmap_t *inode_map = calloc(sb.inode_map_sz, FS_BLOCK_SIZE);
+    struct fs_group_desc *gd = calloc(ngroups, sizeof(struct fs_group_desc));
+    if (block_map == NULL || inode_map == NULL || gd == NULL) {
+        free(block_map);
+        free(inode_map);
+        free(gd);
+        return E_UNAVAIL;
+    }
+
+    int val = SUCCESS;
+    blkno_t root_blk = 0;
+    for (blkno_t g = 0; g < ngroups && val == SUCCESS; g++) {
+        blkno_t first = g * bpg;
+        blkno_t end = (first + bpg < nblks) ? first + bpg : nblks;
+
+        // superblock and descriptors, then maps and inode blocks
+        blkno_t blk = (g == 0) ? 1 + gdt : first;
+        if (groups) {
+            gd[g].block_map = blk++;
+            gd[g].inode_map = blk++;
+        } else {
+            gd[g].inode_map = blk;
+            blk += imap;
+            gd[g].block_map = blk;
+            blk += bmap;
+        }
+        gd[g].inode_table = blk;
+        blk += itb;
+        if (g == 0) {
+            root_blk = blk++;
+        }
+
+        // metadata blocks are in use, as are map bits past the group
+        for (blkno_t b = first; b < blk; b++) {
+            bit_set(block_map, b);
+        }
+        for (blkno_t b = end; b < first + bmap * BITS_PER_BLK; b++) {
+            bit_set(block_map, b);
+        }
+        blkno_t ibase = g * imap * BITS_PER_BLK;
+        for (blkno_t i = ipg; i < imap * BITS_PER_BLK; i++) {
+            bit_set(inode_map, ibase + i);
+        }
+        gd[g].free_blocks = end - blk;
+        gd[g].free_inodes = ipg;
+
+        // inode 0 is never used; inode 1 is the root directory
+        if (g == 0) {
+            bit_set(inode_map, 0);
+            bit_set(inode_map, 1);
+            gd[g].free_inodes -= 2;
+            gd[g].n_dirs = 1;
+        }
+
+        val = write_zeros(dev, gd[g].inode_table, itb);
+    }
+
+    // write maps of each group
+    for (blkno_t g = 0; g < ngroups && val == SUCCESS; g++) {
+        val = dev->ops->write(dev, gd[g].block_map, bmap,
+                              (char*)block_map + g * bmap * FS_BLOCK_SIZE);
+        if (val == SUCCESS) {
+            val = dev->ops->write(dev, gd[g].inode_map, imap,
+                                  (char*)inode_map + g * imap * FS_BLOCK_SIZE);
+        }
+    }
+
+    // write group descriptors
+    if (groups && val == SUCCESS) {
+        struct fs_group_desc *table = calloc(gdt, FS_BLOCK_SIZE);
+        if (table == NULL) {
+            val = E_UNAVAIL;
+        } else {
+            memcpy(table, gd, ngroups * sizeof(struct fs_group_desc));
+            val = dev->ops->write(dev, 1, gdt, table);
+            free(table);
+        }
+    }
+
+    if (val == SUCCESS) {
+        val = write_root(dev, gd[0].inode_table, root_blk);
+    }
+    if (val == SUCCESS) {
+        val = dev->ops->write(dev, 0, 1, &sb);
+    }
+    if (val == SUCCESS) {
+        val = dev->ops->flush(dev, 0, nblks);
+    }
+
+    free(block_map);
+    free(inode_map);
+    free(gd);
+    return val;
+}
@@ -0,0 +1,41 @@
+/*
+ * file:        mkfs.h
+ *
+ * description: create an empty CS 5600 / 7600 file system on a
+ *              block device
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef MKFS_H_
+#define MKFS_H_
+
+#include "blkdev.h"
+
+/** mkfs flag: divide the volume into block groups */
+enum {MKFS_GROUPS = 1};
+
+/** number of blocks for each inode created */
+enum {MKFS_BLKS_PER_INODE = 16};
+
+/**
+ * Create an empty file system with only a root directory on a
+ * block device. Without MKFS_GROUPS, the inode map, block map
+ * and inode blocks follow the superblock. With MKFS_GROUPS, the
+ * volume is divided into groups of BITS_PER_BLK blocks, each
+ * with its own maps and inode blocks, located by a table of
+ * group descriptors after the superblock. A last group too small
+ * for its metadata is left out.
+ *
+ * @param dev the block device
+ * @param nblks the number of blocks to use, or 0 for the whole
+ *   device; at most 2^32 - 1
+ * @param flags 0 or MKFS_GROUPS
+ * @return SUCCESS if successful, E_SIZE if the device is too small
+ *   or, with MKFS_GROUPS, too large for the group descriptors to fit
+ *   in group 0, E_UNAVAIL if cannot allocate memory, or block device
+ *   error
+ */
+extern int mkfs(struct blkdev *dev, blkno_t nblks, int flags);
+
+#endif /* MKFS_H_ */
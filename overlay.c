@@ -0,0 +1,390 @@
+/*
+ * file:        overlay.c
+ *
+ * description: copy-on-write overlay block device for CS 7600 /
+ *              CS 5600 file system. Reads come from a read-only
+ *              base device unless the block has been written to
+ *              the delta file:
+ *
+ *              +--------+------------------+----------------------
+ *              | header | presence bitmap  | block data (sparse)
+ *              +--------+------------------+----------------------
+ *
+ *              Block n of the device is at a fixed offset in the
+ *              data area, so the delta file only takes space for
+ *              blocks that have been written.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE		/* for fallocate and posix_fadvise */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+#include "overlay.h"
+
+/** delta file magic number */
+static const char overlay_magic[8] = "FSXDELT1";
+
+/** delta file header, at offset 0 */
+struct overlay_header {
+    char     magic[8];          // overlay_magic
+    uint64_t nblks;             // number of blocks in device
+    uint64_t map_off;           // file offset of presence bitmap
+    uint64_t data_off;          // file offset of block 0
+};
+
+/** definition of overlay block device */
+struct overlay_dev {
+    struct blkdev *base;        // base block device
+    char *path;                 // path to delta file
+    int   fd;                   // file descriptor of delta file
+    struct overlay_header hdr;  // delta file header
+    unsigned char *map;         // 1 bit per block held in delta
+    size_t map_len;             // length of bitmap in bytes
+    int   map_dirty;            // 1 if bitmap modified since written
+    pthread_mutex_t lock;       // protects bitmap
+};
+
+/**
+ * Determines whether the delta holds a block.
+ *
+ * @param od the overlay device
+ * @param blkno the block number
+ * @return 1 (true) if block is in delta, 0 (false) otherwise
+ */
+static inline int in_delta(struct overlay_dev *od, blkno_t blkno)
+{
+    return (od->map[blkno / 8] >> (blkno % 8)) & 1;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t overlay_num_blocks(struct blkdev *dev)
+{
+    struct overlay_dev *od = dev->private;
+    return od->hdr.nblks;
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ * Each run of blocks held in the delta is read from the delta
+ * file, and each run of other blocks from the base device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot read delta, or error from base device
+ */
+static int overlay_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct overlay_dev *od = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)od->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    char *p = buf;
+    int val = SUCCESS;
+    pthread_mutex_lock(&od->lock);
+    for (int i = 0; i < num_blks && val == SUCCESS; ) {
+        int delta = in_delta(od, first_blk + i);
+        int n = 1;
+        while (i+n < num_blks && in_delta(od, first_blk+i+n) == delta) {
+            n++;
+        }
+        if (delta) {
+            size_t len = (size_t)n * BLOCK_SIZE;
+            off_t off = od->hdr.data_off + (off_t)(first_blk + i) * BLOCK_SIZE;
+            if (pread(od->fd, p + (size_t)i*BLOCK_SIZE, len, off) != (ssize_t)len) {
+                fprintf(stderr, "read error on %s: %s\n", od->path, strerror(errno));
+                val = E_UNAVAIL;
+            }
+        } else {
+            val = od->base->ops->read(od->base, first_blk + i, n, p + (size_t)i*BLOCK_SIZE);
+        }
+        i += n;
+    }
+    pthread_mutex_unlock(&od->lock);
+
+    return val;
+}
+
+/**
+ * Write blocks to the delta file starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   E_UNAVAIL if cannot write delta
+ */
+static int overlay_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct overlay_dev *od = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)od->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    size_t len = (size_t)num_blks * BLOCK_SIZE;
+    off_t off = od->hdr.data_off + (off_t)first_blk * BLOCK_SIZE;
+    if (pwrite(od->fd, buf, len, off) != (ssize_t)len) {
+        fprintf(stderr, "write error on %s: %s\n", od->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+
+    pthread_mutex_lock(&od->lock);
+    for (blkno_t i = first_blk; i < first_blk + num_blks; i++) {
+        od->map[i / 8] |= 1 << (i % 8);
+    }
+    od->map_dirty = 1;
+    pthread_mutex_unlock(&od->lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Flush the block device. The presence bitmap is written if
+ * modified, and the delta file is synced.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if cannot write delta
+ */
+static int overlay_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct overlay_dev *od = dev->private;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&od->lock);
+    if (od->map_dirty) {
+        if (pwrite(od->fd, od->map, od->map_len, od->hdr.map_off) != (ssize_t)od->map_len) {
+            fprintf(stderr, "write error on %s: %s\n", od->path, strerror(errno));
+            val = E_UNAVAIL;
+        } else {
+            od->map_dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&od->lock);
+
+    if (val == SUCCESS && fdatasync(od->fd) < 0) {
+        fprintf(stderr, "sync error on %s: %s\n", od->path, strerror(errno));
+        val = E_UNAVAIL;
+    }
+    return val;
+}
+
+/**
+ * Discard blocks of the block device. Blocks are dropped from
+ * the delta and their space in the delta file is released.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int overlay_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct overlay_dev *od = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)od->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    pthread_mutex_lock(&od->lock);
+    for (blkno_t i = first_blk; i < first_blk + num_blks; i++) {
+        od->map[i / 8] &= ~(1 << (i % 8));
+    }
+    od->map_dirty = 1;
+    pthread_mutex_unlock(&od->lock);
+
+    fallocate(od->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              od->hdr.data_off + (off_t)first_blk * BLOCK_SIZE,
+              (off_t)num_blks * BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Prefetch blocks of the block device. Each run of blocks held
+ * in the delta is prefetched from the delta file, and each run
+ * of other blocks by the base device.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int overlay_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct overlay_dev *od = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > (blkno_t)od->hdr.nblks) {
+        return E_BADADDR;
+    }
+
+    pthread_mutex_lock(&od->lock);
+    for (int i = 0; i < num_blks; ) {
+        int delta = in_delta(od, first_blk + i);
+        int n = 1;
+        while (i+n < num_blks && in_delta(od, first_blk+i+n) == delta) {
+            n++;
+        }
+        if (delta) {
+            posix_fadvise(od->fd, od->hdr.data_off + (off_t)(first_blk + i) * BLOCK_SIZE,
+                          (off_t)n * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+        } else {
+            blkdev_prefetch(od->base, first_blk + i, n);
+        }
+        i += n;
+    }
+    pthread_mutex_unlock(&od->lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Close the block device and the base device.
+ *
+ * @param dev the block device
+ */
+static void overlay_close(struct blkdev *dev)
+{
+    struct overlay_dev *od = dev->private;
+
+    overlay_flush(dev, 0, od->hdr.nblks);
+    close(od->fd);
+    od->base->ops->close(od->base);
+
+    pthread_mutex_destroy(&od->lock);
+    free(od->map);
+    free(od->path);
+    free(od);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops overlay_ops = {
+    .num_blocks = overlay_num_blocks,
+    .read = overlay_read,
+    .write = overlay_write,
+    .flush = overlay_flush,
+    .close = overlay_close,
+    .discard = overlay_discard,
+    .prefetch = overlay_prefetch
+};
+
+/**
+ * Create a copy-on-write overlay block device over a base
+ * device. The base device is only read. Written blocks go to a
+ * delta file, and a bitmap in the delta file records which
+ * blocks it holds. If the delta file does not exist, it is
+ * created empty, so a new volume is ready at once. Closing the
+ * overlay closes the base device.
+ *
+ * @param base the base block device
+ * @param path the path to the delta file
+ * @return the block device or NULL if cannot open or create delta
+ */
+struct blkdev *overlay_create(struct blkdev *base, char *path)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct overlay_dev *od = calloc(1, sizeof(*od));
+    if (dev == NULL || od == NULL) {
+        return NULL;
+    }
+    od->base = base;
+    od->path = strdup(path);    /* save a copy for error reporting */
+
+    od->fd = open(path, O_RDWR | O_CREAT, 0666);
+    struct stat sb;
+    if (od->fd < 0 || fstat(od->fd, &sb) < 0) {
+        fprintf(stderr, "can't open delta %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    blkno_t nblks = base->ops->num_blocks(base);
+    if (sb.st_size == 0) {
+        // new delta: header, then empty bitmap, then data
+        memcpy(od->hdr.magic, overlay_magic, sizeof(overlay_magic));
+        od->hdr.nblks = nblks;
+        od->hdr.map_off = BLOCK_SIZE;
+        od->hdr.data_off = od->hdr.map_off
+                         + ((nblks + 7) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (pwrite(od->fd, &od->hdr, sizeof(od->hdr), 0) != sizeof(od->hdr)) {
+            fprintf(stderr, "write error on %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        od->map_dirty = 1;
+    } else if (pread(od->fd, &od->hdr, sizeof(od->hdr), 0) != sizeof(od->hdr)
+               || memcmp(od->hdr.magic, overlay_magic, sizeof(overlay_magic)) != 0
+               || od->hdr.nblks != (uint64_t)nblks) {
+        fprintf(stderr, "%s is not a delta of a %lld block image\n", path, (long long)nblks);
+        return NULL;
+    }
+
+    od->map_len = (nblks + 7) / 8;
+    if ((od->map = calloc(od->map_len, 1)) == NULL) {
+        return NULL;
+    }
+    if (!od->map_dirty
+        && pread(od->fd, od->map, od->map_len, od->hdr.map_off) != (ssize_t)od->map_len) {
+        fprintf(stderr, "read error on %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    pthread_mutex_init(&od->lock, NULL);
+
+    dev->private = od;
+    dev->ops = &overlay_ops;
+
+    return dev;
+}
+
+/**
+ * Merge a block device, such as an overlay, into a new flat
+ * image file. Blocks of 0s are left as holes in the file.
+ *
+ * @param dev the block device
+ * @param path the path to the flat image file
+ * @return SUCCESS if successful, E_UNAVAIL if cannot read or write
+ */
+int overlay_merge(struct blkdev *dev, char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "can't create image %s: %s\n", path, strerror(errno));
+        return E_UNAVAIL;
+    }
+
+    blkno_t nblks = dev->ops->num_blocks(dev);
+    int val = (ftruncate(fd, (off_t)nblks * BLOCK_SIZE) == 0) ? SUCCESS : E_UNAVAIL;
+    static const char zeros[BLOCK_SIZE];
+    char buf[BLOCK_SIZE];
+    for (blkno_t i = 0; i < nblks && val == SUCCESS; i++) {
+        if ((val = dev->ops->read(dev, i, 1, buf)) == SUCCESS
+            && memcmp(buf, zeros, BLOCK_SIZE) != 0
+            && pwrite(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) {
+            fprintf(stderr, "write error on %s: %s\n", path, strerror(errno));
+            val = E_UNAVAIL;
+        }
+    }
+    if (val == SUCCESS && fsync(fd) < 0) {
+        val = E_UNAVAIL;
+    }
+    close(fd);
+    return val;
+}
@@ -0,0 +1,39 @@
+/*
+ * file:        overlay.h
+ *
+ * description: copy-on-write overlay block device for CS 7600 /
+ *              CS 5600 file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include "blkdev.h"
+
+/**
+ * Create a copy-on-write overlay block device over a base
+ * device. The base device is only read. Written blocks go to a
+ * delta file, and a bitmap in the delta file records which
+ * blocks it holds. If the delta file does not exist, it is
+ * created empty, so a new volume is ready at once. Closing the
+ * overlay closes the base device.
+ *
+ * @param base the base block device
+ * @param path the path to the delta file
+ * @return the block device or NULL if cannot open or create delta
+ */
+extern struct blkdev *overlay_create(struct blkdev *base, char *path);
+
+/**
+ * Merge a block device, such as an overlay, into a new flat
+ * image file. Blocks of 0s are left as holes in the file.
+ *
+ * @param dev the block device
+ * @param path the path to the flat image file
+ * @return SUCCESS if successful, E_UNAVAIL if cannot read or write
+ */
+extern int overlay_merge(struct blkdev *dev, char *path);
+
+#endif /* OVERLAY_H_ */
@@ -0,0 +1,332 @@
+/*
+ * file:        stripe.c
+ *
+ * description: striped (RAID-0) block device for CS 7600 / CS 5600
+ *              file system. Logical blocks are spread in chunks
+ *              across member devices, and requests spanning
+ *              several chunks go to the members in parallel.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "blkdev.h"
+#include "stripe.h"
+#include "min.h"
+
+/** definition of striped block device */
+struct stripe_dev {
+    int   ndevs;                // number of member devices
+    struct blkdev **devs;       // member devices
+    int   chunk;                // blocks per chunk
+    blkno_t nblks;              // number of logical blocks
+};
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t stripe_num_blocks(struct blkdev *dev)
+{
+    struct stripe_dev *sd = dev->private;
+    return sd->nblks;
+}
+
+/**
+ * Read or write blocks of the striped device. The range is
+ * split at chunk boundaries. Consecutive chunks of a member
+ * are adjacent on the member, so each member gets a single
+ * vectored request, and all requests are submitted before
+ * waiting for any of them.
+ *
+ * @param dev the block device
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to transfer
+ * @param buf the buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or error from member device
+ */
+static int stripe_xfer(struct blkdev *dev, int op, blkno_t first_blk, int num_blks, char *buf)
+{
+    struct stripe_dev *sd = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > sd->nblks) {
+        return E_BADADDR;
+    }
+    if (num_blks == 0) {
+        return SUCCESS;
+    }
+
+    // chunks in range, and at most that many per member
+    int nchunks = (first_blk + num_blks - 1) / sd->chunk - first_blk / sd->chunk + 1;
+    int per_dev = (nchunks + sd->ndevs - 1) / sd->ndevs;
+    struct iovec iov[sd->ndevs][per_dev];
+    struct blkdev_req reqs[sd->ndevs];
+    memset(reqs, 0, sizeof(reqs));
+
+    for (blkno_t blk = first_blk; blk < first_blk + num_blks; ) {
+        blkno_t c = blk / sd->chunk;
+        int off = blk % sd->chunk;
+        int n = min(sd->chunk - off, first_blk + num_blks - blk);
+        int d = c % sd->ndevs;
+
+        struct blkdev_req *r = &reqs[d];
+        if (r->iovcnt == 0) {
+            r->op = op;
+            r->first_blk = (c / sd->ndevs) * sd->chunk + off;
+            r->iov = iov[d];
+        }
+        iov[d][r->iovcnt].iov_base = buf + (blk - first_blk) * BLOCK_SIZE;
+        iov[d][r->iovcnt].iov_len = n * BLOCK_SIZE;
+        r->iovcnt++;
+        r->num_blks += n;
+        blk += n;
+    }
+
+    // start requests on all members, then wait for them
+    int val = SUCCESS;
+    for (int d = 0; d < sd->ndevs; d++) {
+        if (reqs[d].iovcnt > 0) {
+            int v = blkdev_submit(sd->devs[d], &reqs[d], 1);
+            if (v != SUCCESS) {
+                reqs[d].iovcnt = 0;  // nothing to wait for
+                if (val == SUCCESS) {
+                    val = v;
+                }
+            }
+        }
+    }
+    for (int d = 0; d < sd->ndevs; d++) {
+        if (reqs[d].iovcnt > 0) {
+            int v = blkdev_complete(sd->devs[d], &reqs[d], 1);
+            if (val == SUCCESS) {
+                val = v;
+            }
+        }
+    }
+    return val;
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or error from member device
+ */
+static int stripe_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return stripe_xfer(dev, BLKDEV_READ, first_blk, num_blks, buf);
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or error from member device
+ */
+static int stripe_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    return stripe_xfer(dev, BLKDEV_WRITE, first_blk, num_blks, buf);
+}
+
+/**
+ * Flush the block device. Each member is flushed over the
+ * range of its blocks holding chunks of the logical range.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, or first error from a member
+ */
+static int stripe_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct stripe_dev *sd = dev->private;
+    int stripe = sd->chunk * sd->ndevs;
+    blkno_t first = (first_blk / stripe) * sd->chunk;
+    blkno_t last = ((first_blk + num_blks + stripe - 1) / stripe) * sd->chunk;
+
+    int val = SUCCESS;
+    for (int d = 0; d < sd->ndevs; d++) {
+        int v = sd->devs[d]->ops->flush(sd->devs[d], first, last - first);
+        if (val == SUCCESS) {
+            val = v;
+        }
+    }
+    return val;
+}
+
+/**
+ * Map a range of blocks to a range on each member. Consecutive
+ * chunks of a member are adjacent on the member, so the blocks
+ * of each member form a single range.
+ *
+ * @param sd the stripe device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks
+ * @param first first member block for each member
+ * @param count number of blocks for each member, 0 if none
+ */
+static void stripe_ranges(struct stripe_dev *sd, blkno_t first_blk, blkno_t num_blks,
+                          blkno_t *first, blkno_t *count)
+{
+    memset(count, 0, sd->ndevs * sizeof(blkno_t));
+    for (blkno_t blk = first_blk; blk < first_blk + num_blks; ) {
+        blkno_t c = blk / sd->chunk;
+        int off = blk % sd->chunk;
+        blkno_t n = sd->chunk - off;
+        if (n > first_blk + num_blks - blk) {
+            n = first_blk + num_blks - blk;
+        }
+        int d = c % sd->ndevs;
+        if (count[d] == 0) {
+            first[d] = (c / sd->ndevs) * sd->chunk + off;
+        }
+        count[d] += n;
+        blk += n;
+    }
+}
+
+/**
+ * Discard blocks of the block device. Each member discards a
+ * single range.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, E_BADADDR if range invalid,
+ *   or first error from a member
+ */
+static int stripe_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct stripe_dev *sd = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > sd->nblks) {
+        return E_BADADDR;
+    }
+
+    blkno_t first[sd->ndevs], count[sd->ndevs];
+    stripe_ranges(sd, first_blk, num_blks, first, count);
+
+    int val = SUCCESS;
+    for (int d = 0; d < sd->ndevs; d++) {
+        if (count[d] > 0) {
+            int v = blkdev_discard(sd->devs[d], first[d], count[d]);
+            if (val == SUCCESS) {
+                val = v;
+            }
+        }
+    }
+    return val;
+}
+
+/**
+ * Prefetch blocks of the block device. Each member prefetches
+ * a single range.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS if successful, E_BADADDR if range invalid
+ */
+static int stripe_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct stripe_dev *sd = dev->private;
+    if (first_blk < 0 || num_blks < 0 || first_blk + num_blks > sd->nblks) {
+        return E_BADADDR;
+    }
+
+    blkno_t first[sd->ndevs], count[sd->ndevs];
+    stripe_ranges(sd, first_blk, num_blks, first, count);
+    for (int d = 0; d < sd->ndevs; d++) {
+        if (count[d] > 0) {
+            blkdev_prefetch(sd->devs[d], first[d], count[d]);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close the block device and its members.
+ *
+ * @param dev the block device
+ */
+static void stripe_close(struct blkdev *dev)
+{
+    struct stripe_dev *sd = dev->private;
+    for (int d = 0; d < sd->ndevs; d++) {
+        sd->devs[d]->ops->close(sd->devs[d]);
+    }
+    free(sd->devs);
+    free(sd);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops stripe_ops = {
+    .num_blocks = stripe_num_blocks,
+    .read = stripe_read,
+    .write = stripe_write,
+    .flush = stripe_flush,
+    .close = stripe_close,
+    .discard = stripe_discard,
+    .prefetch = stripe_prefetch
+};
+
+/**
+ * Create a striped block device over several member devices.
+ * Logical blocks are divided into chunks of chunk_blks blocks,
+ * which are assigned to members round-robin. The device has as
+ * many chunks on each member as fit on the smallest member.
+ * Closing the device closes the members.
+ *
+ * @param devs the member devices
+ * @param ndevs the number of member devices
+ * @param chunk_blks the number of blocks in a chunk
+ * @return the block device or NULL if cannot be created
+ */
+struct blkdev *stripe_create(struct blkdev *devs[], int ndevs, int chunk_blks)
+{
+    if (ndevs <= 0 || chunk_blks <= 0) {
+        return NULL;
+    }
+
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct stripe_dev *sd = malloc(sizeof(*sd));
+    struct blkdev **members = malloc(ndevs * sizeof(struct blkdev*));
+    if (dev == NULL || sd == NULL || members == NULL) {
+        free(dev);
+        free(sd);
+        free(members);
+        return NULL;
+    }
+
+    // whole chunks that fit on the smallest member
+    blkno_t min_blks = devs[0]->ops->num_blocks(devs[0]);
+    for (int d = 0; d < ndevs; d++) {
+        members[d] = devs[d];
+        if (devs[d]->ops->num_blocks(devs[d]) < min_blks) {
+            min_blks = devs[d]->ops->num_blocks(devs[d]);
+        }
+    }
+    sd->ndevs = ndevs;
+    sd->devs = members;
+    sd->chunk = chunk_blks;
+    sd->nblks = (min_blks / chunk_blks) * chunk_blks * ndevs;
+
+    dev->private = sd;
+    dev->ops = &stripe_ops;
+
+    return dev;
+}
@@ -0,0 +1,29 @@
+/*
+ * file:        stripe.h
+ *
+ * description: striped (RAID-0) block device for CS 7600 / CS 5600
+ *              file system
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef STRIPE_H_
+#define STRIPE_H_
+
+#include "blkdev.h"
+
+/**
+ * Create a striped block device over several member devices.
+ * Logical blocks are divided into chunks of chunk_blks blocks,
+ * which are assigned to members round-robin. The device has as
+ * many chunks on each member as fit on the smallest member.
+ * Closing the device closes the members.
+ *
+ * @param devs the member devices
+ * @param ndevs the number of member devices
+ * @param chunk_blks the number of blocks in a chunk
+ * @return the block device or NULL if cannot be created
+ */
+extern struct blkdev *stripe_create(struct blkdev *devs[], int ndevs, int chunk_blks);
+
+#endif /* STRIPE_H_ */
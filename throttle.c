@@ -0,0 +1,407 @@
+/*
+ * file:        throttle.c
+ *
+ * description: throttled block device for benchmarking the CS 7600 /
+ *              CS 5600 file system on slow media. Adds latency,
+ *              bandwidth limits and seek penalties to any block
+ *              device.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "throttle.h"
+
+/** submitted request that has not been completed */
+struct throttle_pend {
+    struct blkdev_req *req;         // the request
+    long  done;                     // time the request finishes, in ns
+    struct throttle_pend *next;     // next pending request
+};
+
+/** definition of throttled block device */
+struct throttle_dev {
+    struct blkdev *dev;             // underlying block device
+    struct throttle_params params;  // simulated device performance
+    blkno_t nblks;                  // number of blocks in device
+    pthread_mutex_t lock;           // protects head, busy and pend
+    blkno_t head;                   // block following last request
+    long  busy;                     // time device is busy until, in ns
+    struct throttle_pend *pend;     // submitted requests not completed
+};
+
+/**
+ * Current time of monotonic clock.
+ *
+ * @return the time in nanoseconds
+ */
+static inline long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Schedule a request on the simulated device. The request
+ * starts when the device is free, and takes the fixed latency,
+ * the seek from the previous request, and the transfer time.
+ *
+ * @param td the throttled device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks transferred
+ * @return the time the request finishes, in ns
+ */
+static long throttle_schedule(struct throttle_dev *td, blkno_t first_blk, int num_blks)
+{
+    const struct throttle_params *p = &td->params;
+    long ns = p->latency_us * 1000;
+    if (p->bandwidth_kb > 0) {
+        ns += (long)num_blks * BLOCK_SIZE * 1000000000L / (p->bandwidth_kb * 1024);
+    }
+
+    pthread_mutex_lock(&td->lock);
+    long dist = labs(first_blk - td->head);
+    if (p->seek_us > 0 && td->nblks > 0) {
+        ns += p->seek_us * 1000 * dist / td->nblks;
+    }
+    long now = now_ns();
+    long start = (td->busy > now) ? td->busy : now;
+    td->busy = start + ns;
+    td->head = first_blk + num_blks;
+    long done = td->busy;
+    pthread_mutex_unlock(&td->lock);
+
+    return done;
+}
+
+/**
+ * Wait until a request finishes on the simulated device.
+ *
+ * @param done the time the request finishes, in ns
+ */
+static void throttle_wait(long done)
+{
+    struct timespec ts = {done / 1000000000L, done % 1000000000L};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // interrupted: sleep again
+    }
+}
+
+/**
+ * Total number of blocks in iovec buffers.
+ *
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return the number of blocks
+ */
+static int iov_blocks(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len / BLOCK_SIZE;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t throttle_num_blocks(struct blkdev *dev)
+{
+    struct throttle_dev *td = dev->private;
+    return td->nblks;
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return result from underlying device
+ */
+static int throttle_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct throttle_dev *td = dev->private;
+    long done = throttle_schedule(td, first_blk, num_blks);
+    int val = td->dev->ops->read(td->dev, first_blk, num_blks, buf);
+    throttle_wait(done);
+    return val;
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return result from underlying device
+ */
+static int throttle_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct throttle_dev *td = dev->private;
+    long done = throttle_schedule(td, first_blk, num_blks);
+    int val = td->dev->ops->write(td->dev, first_blk, num_blks, buf);
+    throttle_wait(done);
+    return val;
+}
+
+/**
+ * Read contiguous blocks into several buffers.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to read
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return result from underlying device
+ */
+static int throttle_readv(struct blkdev *dev, blkno_t first_blk,
+                          const struct iovec *iov, int iovcnt)
+{
+    struct throttle_dev *td = dev->private;
+    long done = throttle_schedule(td, first_blk, iov_blocks(iov, iovcnt));
+    int val = blkdev_readv(td->dev, first_blk, iov, iovcnt);
+    throttle_wait(done);
+    return val;
+}
+
+/**
+ * Write contiguous blocks from several buffers.
+ *
+ * @param dev the block device
+ * @param first_blk the first block to write
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return result from underlying device
+ */
+static int throttle_writev(struct blkdev *dev, blkno_t first_blk,
+                           const struct iovec *iov, int iovcnt)
+{
+    struct throttle_dev *td = dev->private;
+    long done = throttle_schedule(td, first_blk, iov_blocks(iov, iovcnt));
+    int val = blkdev_writev(td->dev, first_blk, iov, iovcnt);
+    throttle_wait(done);
+    return val;
+}
+
+/**
+ * Remove submitted requests from the pending list.
+ *
+ * @param td the throttled device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return the time the last of the requests finishes, in ns,
+ *   or 0 if none are pending
+ */
+static long throttle_take(struct throttle_dev *td, struct blkdev_req *reqs, int nreqs)
+{
+    long done = 0;
+    pthread_mutex_lock(&td->lock);
+    for (int i = 0; i < nreqs; i++) {
+        for (struct throttle_pend **pp = &td->pend; *pp != NULL; pp = &(*pp)->next) {
+            struct throttle_pend *p = *pp;
+            if (p->req == &reqs[i]) {
+                done = (p->done > done) ? p->done : done;
+                *pp = p->next;
+                free(p);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&td->lock);
+    return done;
+}
+
+/**
+ * Submit requests to the underlying device without waiting.
+ * Each request is scheduled on the simulated device, and its
+ * finish time is kept until it is completed, so requests to
+ * several throttled devices are delayed at the same time.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return result from underlying device
+ */
+static int throttle_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct throttle_dev *td = dev->private;
+    long done = 0;
+    for (int i = 0; i < nreqs; i++) {
+        struct blkdev_req *r = &reqs[i];
+        int nblks = (r->iov != NULL) ? iov_blocks(r->iov, r->iovcnt) : r->num_blks;
+        long t = throttle_schedule(td, r->first_blk, nblks);
+        struct throttle_pend *p = malloc(sizeof(*p));
+        if (p == NULL) {
+            // cannot defer the delay: wait for it after submitting
+            done = (t > done) ? t : done;
+            continue;
+        }
+        p->req = r;
+        p->done = t;
+        pthread_mutex_lock(&td->lock);
+        p->next = td->pend;
+        td->pend = p;
+        pthread_mutex_unlock(&td->lock);
+    }
+    int val = blkdev_submit(td->dev, reqs, nreqs);
+    if (val != SUCCESS) {
+        // the requests will not be completed
+        throttle_take(td, reqs, nreqs);
+    } else if (done > 0) {
+        throttle_wait(done);
+    }
+    return val;
+}
+
+/**
+ * Wait for submitted requests to complete, and until they
+ * finish on the simulated device.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return result from underlying device
+ */
+static int throttle_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct throttle_dev *td = dev->private;
+    int val = blkdev_complete(td->dev, reqs, nreqs);
+    long done = throttle_take(td, reqs, nreqs);
+    if (done > 0) {
+        throttle_wait(done);
+    }
+    return val;
+}
+
+/**
+ * Flush the block device. A flush takes the fixed latency.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return result from underlying device
+ */
+static int throttle_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct throttle_dev *td = dev->private;
+    pthread_mutex_lock(&td->lock);
+    long done = td->head;
+    pthread_mutex_unlock(&td->lock);
+    done = throttle_schedule(td, done, 0);
+    int val = td->dev->ops->flush(td->dev, first_blk, num_blks);
+    throttle_wait(done);
+    return val;
+}
+
+/**
+ * Discard blocks of the block device. Discards are not delayed.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return result from underlying device
+ */
+static int throttle_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct throttle_dev *td = dev->private;
+    return blkdev_discard(td->dev, first_blk, num_blks);
+}
+
+/**
+ * Prefetch blocks of the block device. Prefetches are not
+ * delayed; the blocks are charged when they are read.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS
+ */
+static int throttle_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct throttle_dev *td = dev->private;
+    blkdev_prefetch(td->dev, first_blk, num_blks);
+    return SUCCESS;
+}
+
+/**
+ * Close the block device and the underlying device.
+ *
+ * @param dev the block device
+ */
+static void throttle_close(struct blkdev *dev)
+{
+    struct throttle_dev *td = dev->private;
+    td->dev->ops->close(td->dev);
+    while (td->pend != NULL) {
+        struct throttle_pend *p = td->pend;
+        td->pend = p->next;
+        free(p);
+    }
+    pthread_mutex_destroy(&td->lock);
+    free(td);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops throttle_ops = {
+    .num_blocks = throttle_num_blocks,
+    .read = throttle_read,
+    .write = throttle_write,
+    .flush = throttle_flush,
+    .close = throttle_close,
+    .readv = throttle_readv,
+    .writev = throttle_writev,
+    .submit = throttle_submit,
+    .complete = throttle_complete,
+    .discard = throttle_discard,
+    .prefetch = throttle_prefetch
+};
+
+/**
+ * Create a throttled block device layered over an existing
+ * block device. Requests are delayed to simulate a device with
+ * one head: each one takes the fixed latency, plus transfer time
+ * at the bandwidth, plus a seek time proportional to its distance
+ * from the end of the previous request. Requests are served one
+ * after another, so concurrent requests queue behind each other.
+ * Submitted requests are delayed when they are completed, so
+ * requests to several throttled devices overlap.
+ *
+ * @param dev the underlying block device
+ * @param params the simulated device performance
+ * @return the block device or NULL if cannot be allocated
+ */
+struct blkdev *throttle_create(struct blkdev *dev, const struct throttle_params *params)
+{
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    struct blkdev *tdev = malloc(sizeof(*tdev));
+    struct throttle_dev *td = calloc(1, sizeof(*td));
+    if (tdev == NULL || td == NULL) {
+        free(tdev);
+        free(td);
+        return NULL;
+    }
+    td->dev = dev;
+    td->params = *params;
+    td->nblks = dev->ops->num_blocks(dev);
+    pthread_mutex_init(&td->lock, NULL);
+
+    tdev->private = td;
+    tdev->ops = &throttle_ops;
+
+    return tdev;
+}
@@ -0,0 +1,39 @@
+/*
+ * file:        throttle.h
+ *
+ * description: throttled block device for benchmarking the CS 7600 /
+ *              CS 5600 file system on slow media
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include "blkdev.h"
+
+/** simulated device performance; 0 disables a setting */
+struct throttle_params {
+    long latency_us;    /* fixed time per request */
+    long bandwidth_kb;  /* transfer rate in KiB per second */
+    long seek_us;       /* time to seek across the whole device */
+};
+
+/**
+ * Create a throttled block device layered over an existing
+ * block device. Requests are delayed to simulate a device with
+ * one head: each one takes the fixed latency, plus transfer time
+ * at the bandwidth, plus a seek time proportional to its distance
+ * from the end of the previous request. Requests are served one
+ * after another, so concurrent requests queue behind each other.
+ * Submitted requests are delayed when they are completed, so
+ * requests to several throttled devices overlap.
+ *
+ * @param dev the underlying block device
+ * @param params the simulated device performance
+ * @return the block device or NULL if cannot be allocated
+ */
+extern struct blkdev *throttle_create(struct blkdev *dev,
+                                      const struct throttle_params *params);
+
+#endif /* THROTTLE_H_ */
@@ -0,0 +1,416 @@
+/*
+ * file:        wqueue.c
+ *
+ * description: write coalescing queue for CS 7600 / CS 5600 file
+ *              system, layered over any other block device. Works
+ *              like an elevator: queued writes are sorted by block
+ *              number and adjacent blocks go out as one request.
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "blkbuf.h"
+#include "wqueue.h"
+
+/** maximum number of blocks merged into one write */
+enum {WQ_MAX_RUN = 256};
+
+/** queued block */
+struct wq_ent {
+    blkno_t blkno;              // block number
+    char *data;                 // block content, from blkbuf_alloc()
+    struct wq_ent *hnext;       // next entry in hash chain
+};
+
+/** definition of write queue block device */
+struct wq_dev {
+    struct blkdev *dev;         // underlying block device
+    int   max_dirty;            // queue capacity
+    int   ndirty;               // number of queued blocks
+    struct wq_ent *ents;        // queued blocks: ents[0..ndirty-1]
+    int   hmask;                // hash table size - 1
+    struct wq_ent **hash;       // hash chains by block number
+    pthread_mutex_t lock;       // protects queue state
+};
+
+/**
+ * Hash bucket index for a block number.
+ *
+ * @param wq the write queue device
+ * @param blkno the block number
+ * @return the hash bucket index
+ */
+static inline int wq_hash(struct wq_dev *wq, blkno_t blkno)
+{
+    return (int)(((unsigned)(blkno ^ (blkno >> 32)) * 2654435761u) >> 7) & wq->hmask;
+}
+
+/**
+ * Find queued block.
+ *
+ * @param wq the write queue device
+ * @param blkno the block number
+ * @return the entry or NULL if not queued
+ */
+static struct wq_ent *wq_lookup(struct wq_dev *wq, blkno_t blkno)
+{
+    struct wq_ent *e = wq->hash[wq_hash(wq, blkno)];
+    while (e != NULL && e->blkno != blkno) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+/**
+ * Rebuild the hash chains after entries have been moved.
+ *
+ * @param wq the write queue device
+ */
+static void wq_rehash(struct wq_dev *wq)
+{
+    memset(wq->hash, 0, (wq->hmask+1) * sizeof(struct wq_ent*));
+    for (int i = 0; i < wq->ndirty; i++) {
+        struct wq_ent *e = &wq->ents[i];
+        int h = wq_hash(wq, e->blkno);
+        e->hnext = wq->hash[h];
+        wq->hash[h] = e;
+    }
+}
+
+/**
+ * Compare queued entries by block number for qsort.
+ */
+static int wq_cmp(const void *a, const void *b)
+{
+    blkno_t x = ((const struct wq_ent*)a)->blkno;
+    blkno_t y = ((const struct wq_ent*)b)->blkno;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write all queued blocks to the underlying device. Entries are
+ * sorted by block number and each run of adjacent blocks is
+ * submitted as one vectored request. Blocks whose write fails
+ * stay queued. Caller holds the lock.
+ *
+ * @param wq the write queue device
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int wq_drain(struct wq_dev *wq)
+{
+    int n = wq->ndirty;
+    if (n == 0) {
+        return SUCCESS;
+    }
+    qsort(wq->ents, n, sizeof(struct wq_ent), wq_cmp);
+
+    struct iovec *iov = malloc(n * sizeof(struct iovec));
+    struct blkdev_req *reqs = malloc(n * sizeof(struct blkdev_req));
+    if (iov == NULL || reqs == NULL) {
+        free(iov);
+        free(reqs);
+        return E_UNAVAIL;
+    }
+
+    // one request per run of adjacent blocks
+    int nreqs = 0;
+    for (int i = 0; i < n; ) {
+        int len = 1;
+        while (i+len < n && len < WQ_MAX_RUN
+               && wq->ents[i+len].blkno == wq->ents[i].blkno + len) {
+            len++;
+        }
+        for (int j = 0; j < len; j++) {
+            iov[i+j].iov_base = wq->ents[i+j].data;
+            iov[i+j].iov_len = BLOCK_SIZE;
+        }
+        reqs[nreqs++] = (struct blkdev_req) {
+            .op = BLKDEV_WRITE, .first_blk = wq->ents[i].blkno,
+            .num_blks = len, .iov = &iov[i], .iovcnt = len
+        };
+        i += len;
+    }
+
+    int val = blkdev_submit(wq->dev, reqs, nreqs);
+    if (val == SUCCESS) {
+        val = blkdev_complete(wq->dev, reqs, nreqs);
+    } else {
+        for (int r = 0; r < nreqs; r++) {
+            reqs[r].status = val;
+        }
+    }
+
+    // release written blocks, keep failed ones queued
+    int kept = 0, i = 0;
+    for (int r = 0; r < nreqs; r++) {
+        for (int j = 0; j < reqs[r].num_blks; j++, i++) {
+            if (reqs[r].status == SUCCESS) {
+                blkbuf_free(wq->ents[i].data, 1);
+            } else {
+                wq->ents[kept++] = wq->ents[i];
+            }
+        }
+    }
+    wq->ndirty = kept;
+    wq_rehash(wq);
+
+    free(iov);
+    free(reqs);
+    return val;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static blkno_t wq_num_blocks(struct blkdev *dev)
+{
+    struct wq_dev *wq = dev->private;
+    return wq->dev->ops->num_blocks(wq->dev);
+}
+
+/**
+ * Read blocks from block device starting at give block offset.
+ * Queued blocks are copied from the queue; runs of blocks not
+ * queued are read from the underlying device with one request.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int wq_read(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct wq_dev *wq = dev->private;
+    char *p = buf;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&wq->lock);
+    for (int i = 0; i < num_blks && val == SUCCESS; ) {
+        struct wq_ent *e = wq_lookup(wq, first_blk + i);
+        if (e != NULL) {
+            memcpy(p + i*BLOCK_SIZE, e->data, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        int n = 1;
+        while (i+n < num_blks && wq_lookup(wq, first_blk+i+n) == NULL) {
+            n++;
+        }
+        val = wq->dev->ops->read(wq->dev, first_blk + i, n, p + i*BLOCK_SIZE);
+        i += n;
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return val;
+}
+
+/**
+ * Write blocks to block device starting at give block offset.
+ * Blocks are queued, replacing any queued copy, and the queue
+ * is drained when full.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int wq_write(struct blkdev *dev, blkno_t first_blk, int num_blks, void *buf)
+{
+    struct wq_dev *wq = dev->private;
+    char *p = buf;
+    int val = SUCCESS;
+
+    pthread_mutex_lock(&wq->lock);
+    for (int i = 0; i < num_blks && val == SUCCESS; i++) {
+        struct wq_ent *e = wq_lookup(wq, first_blk + i);
+        if (e == NULL) {
+            if (wq->ndirty == wq->max_dirty
+                && (val = wq_drain(wq)) != SUCCESS) {
+                break;
+            }
+            char *data = blkbuf_alloc(1);
+            if (data == NULL) {
+                // cannot queue: write this block through
+                val = wq->dev->ops->write(wq->dev, first_blk + i, 1, p + i*BLOCK_SIZE);
+                continue;
+            }
+            e = &wq->ents[wq->ndirty++];
+            e->blkno = first_blk + i;
+            e->data = data;
+            int h = wq_hash(wq, e->blkno);
+            e->hnext = wq->hash[h];
+            wq->hash[h] = e;
+        }
+        memcpy(e->data, p + i*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return val;
+}
+
+/**
+ * Flush the block device. The queue is drained and the
+ * underlying device is flushed.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int wq_flush(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct wq_dev *wq = dev->private;
+
+    pthread_mutex_lock(&wq->lock);
+    int val = wq_drain(wq);
+    pthread_mutex_unlock(&wq->lock);
+
+    if (val == SUCCESS) {
+        val = wq->dev->ops->flush(wq->dev, first_blk, num_blks);
+    }
+    return val;
+}
+
+/**
+ * Discard blocks of the block device. Queued writes of the
+ * blocks are dropped, and the underlying device is told to
+ * discard them.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to discard
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int wq_discard(struct blkdev *dev, blkno_t first_blk, blkno_t num_blks)
+{
+    struct wq_dev *wq = dev->private;
+
+    pthread_mutex_lock(&wq->lock);
+    int kept = 0;
+    for (int i = 0; i < wq->ndirty; i++) {
+        struct wq_ent *e = &wq->ents[i];
+        if (e->blkno >= first_blk && e->blkno < first_blk+num_blks) {
+            blkbuf_free(e->data, 1);
+        } else {
+            wq->ents[kept++] = *e;
+        }
+    }
+    if (kept < wq->ndirty) {
+        wq->ndirty = kept;
+        wq_rehash(wq);
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return blkdev_discard(wq->dev, first_blk, num_blks);
+}
+
+/**
+ * Prefetch blocks of the block device. Queued blocks are read
+ * from the queue, so only the underlying device is told.
+ *
+ * @param dev the block device
+ * @param first_blk starting block offset
+ * @param num_blks number of blocks to prefetch
+ * @return SUCCESS
+ */
+static int wq_prefetch(struct blkdev *dev, blkno_t first_blk, int num_blks)
+{
+    struct wq_dev *wq = dev->private;
+    blkdev_prefetch(wq->dev, first_blk, num_blks);
+    return SUCCESS;
+}
+
+/**
+ * Close the block device. Queued blocks are written and the
+ * underlying device is closed.
+ *
+ * @param dev the block device
+ */
+static void wq_close(struct blkdev *dev)
+{
+    struct wq_dev *wq = dev->private;
+
+    wq_flush(dev, 0, wq_num_blocks(dev));
+    wq->dev->ops->close(wq->dev);
+
+    for (int i = 0; i < wq->ndirty; i++) {
+        blkbuf_free(wq->ents[i].data, 1);
+    }
+    pthread_mutex_destroy(&wq->lock);
+    free(wq->hash);
+    free(wq->ents);
+    free(wq);
+    dev->private = NULL;
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops wq_ops = {
+    .num_blocks = wq_num_blocks,
+    .read = wq_read,
+    .write = wq_write,
+    .flush = wq_flush,
+    .close = wq_close,
+    .discard = wq_discard,
+    .prefetch = wq_prefetch
+};
+
+/**
+ * Create a write queue block device layered over an existing
+ * block device. Written blocks are held in the queue until it
+ * has max_dirty blocks or is flushed. The queue is then drained
+ * in block number order, with adjacent blocks merged into one
+ * multi-block write.
+ *
+ * @param dev the underlying block device
+ * @param max_dirty the number of blocks queued before draining
+ * @return the block device or NULL if cannot allocate queue
+ */
+struct blkdev *wqueue_create(struct blkdev *dev, int max_dirty)
+{
+    if (dev == NULL || max_dirty <= 0) {
+        return NULL;
+    }
+
+    struct blkdev *qdev = malloc(sizeof(*qdev));
+    struct wq_dev *wq = calloc(1, sizeof(*wq));
+    if (qdev == NULL || wq == NULL) {
+        free(qdev);
+        free(wq);
+        return NULL;
+    }
+
+    // hash table is a power of 2 at least as large as the queue
+    int nhash = 1;
+    while (nhash < max_dirty) {
+        nhash <<= 1;
+    }
+
+    wq->dev = dev;
+    wq->max_dirty = max_dirty;
+    wq->hmask = nhash - 1;
+    wq->ents = calloc(max_dirty, sizeof(struct wq_ent));
+    wq->hash = calloc(nhash, sizeof(struct wq_ent*));
+    if (wq->ents == NULL || wq->hash == NULL) {
+        free(wq->ents);
+        free(wq->hash);
+        free(wq);
+        free(qdev);
+        return NULL;
+    }
+    pthread_mutex_init(&wq->lock, NULL);
+
+    qdev->private = wq;
+    qdev->ops = &wq_ops;
+
+    return qdev;
+}
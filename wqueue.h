@@ -0,0 +1,28 @@
+/*
+ * file:        wqueue.h
+ *
+ * description: write coalescing queue for CS 7600 / CS 5600 file
+ *              system, layered over any other block device
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ */
+
+#ifndef WQUEUE_H_
+#define WQUEUE_H_
+
+#include "blkdev.h"
+
+/**
+ * Create a write queue block device layered over an existing
+ * block device. Written blocks are held in the queue until it
+ * has max_dirty blocks or is flushed. The queue is then drained
+ * in block number order, with adjacent blocks merged into one
+ * multi-block write.
+ *
+ * @param dev the underlying block device
+ * @param max_dirty the number of blocks queued before draining
+ * @return the block device or NULL if cannot allocate queue
+ */
+extern struct blkdev *wqueue_create(struct blkdev *dev, int max_dirty);
+
+#endif /* WQUEUE_H_ */